@@ -0,0 +1,17 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASH_LOG        12 ///< The compressor remembers 2^LZ4_HASH_LOG positions
+#define LZ4_HASH_SIZE       (1 << LZ4_HASH_LOG)
+#define LZ4_MIN_MATCH       4 ///< The shortest match that's encoded
+#define LZ4_LAST_LITERALS   5 ///< The last bytes of a block are always literals
+#define LZ4_MFLIMIT         12 ///< No match starts in the last LZ4_MFLIMIT bytes of a block
+#define LZ4_MAX_INPUT       0x10000 ///< The positions are kept in 16 bits, so the input is at most 64KB
+
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap, uint16_t *table);
+size_t lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+#endif // LZ4_H
@@ -0,0 +1,48 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+/**
+ * @brief Returns the struct that contains a tree node
+ */
+#define rb_entry(ptr, type, member) ((type *)((uint8_t *)(ptr) - offsetof(type, member)))
+
+/**
+ * @brief A red-black tree node, embedded in the struct it orders
+ */
+struct rb_node {
+    struct rb_node *parent; ///< The parent node, NULL for the root
+    struct rb_node *left; ///< The subtree with the smaller keys
+    struct rb_node *right; ///< The subtree with the bigger keys
+    int color; ///< RB_RED or RB_BLACK
+};
+
+/**
+ * @brief The root of a red-black tree
+ */
+struct rb_root {
+    struct rb_node *node; ///< The root node, NULL if the tree is empty
+};
+
+/**
+ * @brief Recomputes the augmented value of a node from the node itself and its children
+ * Called on every node whose subtree changed, children before parents
+ */
+typedef void (*rb_augment_fn)(struct rb_node *node);
+
+void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link);
+void rb_insert_color(struct rb_node *node, struct rb_root *root, rb_augment_fn augment);
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_fn augment);
+void rb_augment_propagate(struct rb_node *node, rb_augment_fn augment);
+
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+#endif // RBTREE_H
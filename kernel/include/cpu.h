@@ -3,13 +3,26 @@
 
 #include <stdint.h>
 
+#define CR0_WP_BIT (1ULL << 16)
 #define CR4_PGE_BIT (1ULL << 7)
+#define CR4_PCIDE_BIT (1ULL << 17)
+
+#define CPUID_FEATURES_LEAF     0x1 ///< Processor features
+#define CPUID_ECX_PCID          (1U << 17) ///< Process context identifiers are supported
+
+#define CPUID_EXT_MAX_LEAF      0x80000000 ///< Returns the highest extended cpuid leaf
+#define CPUID_EXT_FEATURES_LEAF 0x80000001 ///< Extended processor features
+#define CPUID_EXT_EDX_PDPE1GB   (1U << 26) ///< 1GB pages are supported
 
 __attribute__((noreturn)) void hcf(void);
 void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
 inline uint64_t cpu_rdmsr(uint32_t msr_index);
 inline void cpu_wrmsr(uint32_t msr_index, uint64_t value);
 
+inline uint64_t read_cr0();
+inline void write_cr0(uint64_t val);
+inline uint64_t read_cr3();
+inline void write_cr3(uint64_t val);
 inline uint64_t read_cr4();
 inline void write_cr4(uint64_t val);
 
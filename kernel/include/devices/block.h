@@ -0,0 +1,25 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOCK_SECTOR_SIZE 512 ///< The default sector size
+
+/**
+ * @brief A device that is read and written in sectors
+ * The driver fills the geometry and the operations
+ */
+struct block_device {
+    const char *name; ///< The name of the device, for the logs
+    uint64_t sector_size; ///< The size of a sector in bytes
+    uint64_t sector_count; ///< How many sectors the device has
+    bool (*read)(struct block_device *dev, uint64_t lba, uint64_t count, void *buffer); ///< Reads count sectors starting from lba
+    bool (*write)(struct block_device *dev, uint64_t lba, uint64_t count, const void *buffer); ///< Writes count sectors starting from lba
+    void *data; ///< The private data of the driver
+};
+
+bool block_read(struct block_device *dev, uint64_t lba, uint64_t count, void *buffer);
+bool block_write(struct block_device *dev, uint64_t lba, uint64_t count, const void *buffer);
+
+#endif // BLOCK_H
@@ -26,6 +26,8 @@ void timer_handler(void);
 
 uint64_t timer_get_uptime_ms();
 uint64_t timer_get_uptime_ticks();
+uint64_t timer_get_tsc(void);
+uint64_t timer_tsc_to_ns(uint64_t cycles);
 
 void timer_sleep();
 
@@ -0,0 +1,21 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <devices/block.h>
+#include <stdint.h>
+
+#define RAMDISK_CHUNK_SIZE 0x400000 ///< The storage is allocated in physical blocks of this size (the biggest pmm block)
+
+/**
+ * @brief A block device backed by physical memory
+ * The storage is accessed through the hhdm, so it's never demand paged
+ */
+struct ramdisk {
+    struct block_device dev; ///< The block device, must be the first member
+    uint64_t *chunks; ///< The physical addresses of the storage blocks
+    uint64_t nr_chunks; ///< How many storage blocks there are
+};
+
+struct block_device *ramdisk_create(const char *name, uint64_t size);
+
+#endif // RAMDISK_H
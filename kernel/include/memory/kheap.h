@@ -9,6 +9,9 @@
 #define KHEAP_MIN_SPLITTING_SIZE 16 ///< How much memory does a block need to be splitted
 #define KHEAP_BLOCK_SIZE 16 ///< An alignment made to each size request
 #define KHEAP_EXTENDING_AMOUNT 0x100000 ///< How much memory to extend our heap
+#define KHEAP_TRIM_THRESHOLD 0x400000 ///< How much free memory at the tail of the heap triggers a trim (4MB)
+#define KHEAP_TRIM_RETAIN KHEAP_EXTENDING_AMOUNT ///< How much free memory at the tail survives a trim
+#define KHEAP_LARGE_THRESHOLD 0x20000 ///< Allocations of at least this size (128KB) bypass the heap and get their own pages
 
 /**
  * @brief This struct describes a single region of the kernel heap
@@ -21,11 +24,21 @@ struct kheap_node
     uint64_t size; ///< The size of the region EXCLUDING its header size
     bool isFree; ///< Is this region free?
     struct kheap_node *next; ///< A pointer to the next node 
-};
+#ifdef KHEAP_PROFILER
+    uint32_t prof_site; ///< The profiler site of this allocation (0 if it wasn't sampled)
+#endif
+} __attribute__((aligned(KHEAP_BLOCK_SIZE))); // So every region starts on a KHEAP_BLOCK_SIZE boundary
 
 void kheap_init(void);
 bool kheap_extend(size_t size);
+void kheap_trim(void);
 void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void* kcalloc(size_t count, size_t size);
+void* krealloc(void *ptr, size_t size);
+void* kmalloc_aligned(size_t size, size_t align);
+void* kmalloc_contig(size_t size, uint64_t *phys);
+void kfree_contig(void *ptr);
 void kfree(void *ptr);
 void kheap_print_nodes();
 
@@ -0,0 +1,43 @@
+#ifndef KHEAP_PROF_H
+#define KHEAP_PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KHEAP_PROF_SITES 512 ///< How many call sites the profiler can track (power of 2)
+#define KHEAP_PROF_DEFAULT_RATE 16 ///< On average we sample one allocation every KHEAP_PROF_DEFAULT_RATE
+#define KHEAP_PROF_LARGE_SLOTS 128 ///< How many sampled large allocations can be live at once
+
+/**
+ * @brief The statistics of a single allocation site
+ * Every counter refers only to the sampled allocations,
+ * multiply them by the sampling rate to get an estimate of the real values
+ */
+struct kheap_prof_site
+{
+    uint64_t caller; ///< The return address of the allocating call (0 if the slot is empty)
+    uint64_t samples; ///< How many allocations were sampled
+    uint64_t sampled_bytes; ///< How many bytes the sampled allocations requested
+    uint64_t live_samples; ///< How many sampled allocations aren't freed yet
+    uint64_t live_bytes; ///< How many bytes the live sampled allocations hold
+};
+
+/**
+ * @brief A sampled large allocation
+ * Large allocations have no heap header, so we remember their site here
+ */
+struct kheap_prof_large
+{
+    void *ptr; ///< The address returned to the caller (NULL if the slot is empty)
+    uint64_t size; ///< The size accounted to the site
+    uint32_t site; ///< The site index + 1
+};
+
+void kheap_prof_set_rate(uint32_t rate);
+uint32_t kheap_prof_alloc(uint64_t caller, uint64_t size);
+void kheap_prof_free(uint32_t site, uint64_t size);
+void kheap_prof_large_set(void *ptr, uint64_t size, uint32_t site);
+void kheap_prof_large_take(void *ptr);
+void kheap_prof_dump(void);
+
+#endif // KHEAP_PROF_H
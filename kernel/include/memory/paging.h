@@ -7,6 +7,7 @@
 
 #define PAGING_PAGE_SIZE       4096
 #define PAGING_HUGE_PAGE_SIZE  0x200000
+#define PAGING_GIANT_PAGE_SIZE 0x40000000
 
 /**
  * @name Page table entries flags
@@ -24,11 +25,31 @@
 #define PTE_FLAG_US         (1ull << 2)
 #define PTE_FLAG_RW         (1ull << 1)
 #define PTE_FLAG_PRESENT    (1ull << 0)
+#define PTE_FLAG_SOFT_DIRTY (1ull << 55) ///< Software bit: the page was dirty when the hardware bit was harvested
+#define PTE_FLAG_SOFT_ACCESSED (1ull << 56) ///< Software bit: the accessed bit was harvested by page reclaim
+#define PTE_FLAG_LAZY_FREE  (1ull << 57) ///< Software bit: the content isn't needed, reclaim can drop the page while it's clean
+#define PTE_AGE_SHIFT       52 ///< Software bits 52-54: scans since the page was last accessed
+#define PTE_AGE_MASK        (7ull << PTE_AGE_SHIFT)
+#define PTE_AGE_MAX         7
+#define PTE_GET_AGE(entry)  (((entry) & PTE_AGE_MASK) >> PTE_AGE_SHIFT)
+#define PTE_USAGE_MASK      (PTE_FLAG_ACCESSED | PTE_FLAG_DIRTY | PTE_FLAG_SOFT_DIRTY | PTE_FLAG_SOFT_ACCESSED | PTE_FLAG_LAZY_FREE | PTE_AGE_MASK) ///< Bits that track usage, not attributes
 #define PTE_CACHE_WC        PTE_FLAG_PWT
 #define PTE_CACHE_UC        PTE_FLAG_PCD
 #define PTE_CACHE_WB        0
 /** @} */
 
+/**
+ * @name Swap entries
+ * A swapped out page has a non present page table entry that holds its swap slot
+ * @{
+ */
+#define PTE_FLAG_SWAP           (1ull << 9) ///< Software bit of a non present entry: it holds a swap slot
+#define PTE_SWAP_SLOT_SHIFT     12
+#define PTE_MAKE_SWAP(slot)     (((uint64_t)(slot) << PTE_SWAP_SLOT_SHIFT) | PTE_FLAG_SWAP)
+#define PTE_IS_SWAP(entry)      (((entry) & (PTE_FLAG_SWAP | PTE_FLAG_PRESENT)) == PTE_FLAG_SWAP)
+#define PTE_SWAP_SLOT(entry)    (((entry) & PAGING_PTE_ADDR_MASK) >> PTE_SWAP_SLOT_SHIFT)
+/** @} */
+
 /**
  * @name Page fault error code flags
  * @{
@@ -55,8 +76,86 @@
 #define PAGING_GET_FRAME_OFFSET(virtAddress)   ((virtAddress) & 0xFFF)
 /** @} */
 
+/**
+ * @name Page table levels
+ * Used by the range walkers, level 1 is the page table and level 4 the pml4
+ * @{
+ */
+#define PAGING_LEVEL_PT     1
+#define PAGING_LEVEL_PD     2
+#define PAGING_LEVEL_PDPR   3
+#define PAGING_LEVEL_PML4   4
+#define PAGING_LEVEL_SHIFT(level)               (12 + 9 * ((level) - 1)) ///< How many bits of the address an entry of this level covers
+#define PAGING_LEVEL_SIZE(level)                (1ull << PAGING_LEVEL_SHIFT(level)) ///< How many bytes an entry of this level covers
+#define PAGING_LEVEL_INDEX(virtAddress, level)  (((virtAddress) >> PAGING_LEVEL_SHIFT(level)) & 0x1FF)
+/** @} */
+
+#define PAGING_PML4_KERNEL_INDEX 256 ///< The first pml4 entry of the higher half, shared by every address space
+
 #define PAGING_PTE_ADDR_MASK 0x000FFFFFFFFFF000 ///< The physical address mask to use on a page table entry
 
+/**
+ * @name TLB batching
+ * @{
+ */
+#define PAGING_BATCH_MAX_PAGES      64 ///< How many single invalidations a batch can hold
+#define PAGING_BATCH_MAX_FREES      64 ///< How many frames a batch can defer before flushing early
+#define PAGING_FLUSH_THRESHOLD      33 ///< Default number of pages past which a full flush is cheaper than invlpg
+/** @} */
+
+/**
+ * @brief Gathers the tlb invalidations of a page table operation
+ * The pages are invalidated together by paging_batch_flush, with invlpg one by one
+ * or with a full flush when there are too many of them.
+ * Frames unmapped inside the batch are released only after the flush, so no cpu
+ * can still reach a frame through a stale translation once it's reused
+ */
+struct paging_tlb_batch
+{
+    uint64_t pages[PAGING_BATCH_MAX_PAGES]; ///< The virtual addresses to invalidate
+    uint64_t count; ///< How many addresses are in pages
+    bool flush_all; ///< Too many pages, the whole tlb will be flushed
+    bool global; ///< At least one of the pages was global
+    uint64_t frees[PAGING_BATCH_MAX_FREES]; ///< The frames to release after the flush
+    uint64_t nr_frees; ///< How many frames are in frees
+};
+
+/**
+ * @name Process context identifiers
+ * @{
+ */
+#define PAGING_PCID_COUNT   4096 ///< PCIDs are 12 bits wide, 0 belongs to the kernel
+#define PAGING_CR3_NOFLUSH  (1ull << 63) ///< Keep the tlb entries tagged with the new pcid on a cr3 write
+/** @} */
+
+/**
+ * @brief The state of a page table dump
+ * Consecutive leaves with the same size and attributes are printed as a single run
+ */
+struct paging_dump_state
+{
+    uint64_t start; ///< The first address to dump
+    uint64_t end; ///< The last address to dump (included)
+    uint64_t run_start; ///< The first address of the current run
+    uint64_t run_end; ///< The end of the current run (excluded)
+    uint64_t run_page_size; ///< The page size of the current run, 0 if there's no run
+    uint64_t run_flags; ///< The attributes of the current run
+    uint64_t tables[PAGING_LEVEL_PML4 + 1]; ///< How many table pages are used at each level
+    uint64_t leaves[PAGING_LEVEL_PML4 + 1]; ///< How many leaves are mapped at each level
+};
+
+/**
+ * @brief What an accessed/dirty scan found
+ * Every counter is in 4KB pages, a huge page counts as all the small pages it covers
+ */
+struct paging_access_stats
+{
+    uint64_t resident; ///< Pages mapped
+    uint64_t accessed; ///< Pages accessed since the previous scan (the working set)
+    uint64_t dirty; ///< Pages written since the previous scan
+    uint64_t age_histogram[PTE_AGE_MAX + 1]; ///< Pages by scans since their last access, 0 is hot
+};
+
 #define MSR_IA32_PAT 0x277 ///< The msr for managing the PAT
 
 /**
@@ -74,9 +173,32 @@ void paging_init(void);
 void paging_map_page(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, bool isHugePage);
 void paging_map_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags, bool isHugePage);
 void paging_unmap_page(uint64_t *pml4_root, uint64_t virt_addr, bool isHugePage, bool freePhysical);
+void paging_protect_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, uint64_t flags, bool cow);
 void paging_unmap_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, bool isHugePage, bool freePhysical);
 void paging_change_page_flags(uint64_t *pml4_root, uint64_t virt_addr, uint64_t flags, bool isHugePage);
+uint64_t *paging_get_entry(uint64_t *pml4_root, uint64_t virt_addr, int *level);
+void paging_dump(uint64_t *pml4_root, uint64_t start, uint64_t end);
+bool paging_clone_region(uint64_t *src_root, uint64_t *dst_root, uint64_t virt_addr, uint64_t size, bool cow);
+void paging_scan_accessed(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, struct paging_access_stats *stats);
+bool paging_test_and_clear_young(uint64_t *pml4_root, uint64_t virt_addr);
+uint64_t paging_set_swap_entry(uint64_t *pml4_root, uint64_t virt_addr, uint64_t swap_entry);
+bool paging_mark_lazy_free(uint64_t *pml4_root, uint64_t virt_addr);
+bool paging_split_huge_page(uint64_t *pml4_root, uint64_t virt_addr);
+bool set_memory_ro(uint64_t vaddr, uint64_t npages);
+bool set_memory_rw(uint64_t vaddr, uint64_t npages);
+bool set_memory_nx(uint64_t vaddr, uint64_t npages);
+bool set_memory_x(uint64_t vaddr, uint64_t npages);
+bool set_memory_wc(uint64_t vaddr, uint64_t npages);
+bool set_memory_uc(uint64_t vaddr, uint64_t npages);
+bool set_memory_wb(uint64_t vaddr, uint64_t npages);
 inline void paging_switch_context(uint64_t *kernel_pml4_phys);
+void paging_switch_context_pcid(uint64_t *pml4_phys, uint16_t pcid, bool flush);
+bool paging_pcid_enabled(void);
+void paging_set_flush_threshold(uint64_t pages);
+void paging_batch_init(struct paging_tlb_batch *batch);
+void paging_batch_add(struct paging_tlb_batch *batch, uint64_t virt_addr, bool global);
+void paging_batch_defer_free(struct paging_tlb_batch *batch, uint64_t phys_addr);
+void paging_batch_flush(struct paging_tlb_batch *batch);
 uint64_t *paging_getKernelRoot(void);
 
 #endif // PAGING_H
\ No newline at end of file
@@ -9,6 +9,20 @@
 
 #define PMM_MAX_ORDER       11 // Maximum buddy size 2^22 = 4MB
 
+#define PMM_RECLAIM_MAX_ORDER   3 ///< Allocations bigger than this fail instead of entering direct reclaim
+#define PMM_WMARK_MIN_DIVISOR   256 ///< The min watermark is this fraction of the free memory at boot
+
+/**
+ * @name PMM watermarks
+ * Below low the background reclaim is started, it stops once we're above high.
+ * Below min only the reclaimer and page tables (pmm_alloc_atomic) can allocate
+ * @{
+ */
+#define PMM_WMARK_MIN       0
+#define PMM_WMARK_LOW       1
+#define PMM_WMARK_HIGH      2
+/** @} */
+
 /**
  * @name PMM page type
  * @{
@@ -16,8 +30,12 @@
 #define PMM_FLAG_FREE       1
 #define PMM_FLAG_USED       1 << 1
 #define PMM_FLAG_RESERVED   1 << 2
+#define PMM_FLAG_LRU        1 << 3 ///< The page is on an LRU list, its link is used by the list
+#define PMM_FLAG_ACTIVE     1 << 4 ///< The page is on the active LRU list
 /** @} */
 
+struct vm_address_space;
+
 /**
  * @brief A node that describes a physical memory region 
  * This region is 2^(12 + order) bytes long, it has a reference count
@@ -28,9 +46,18 @@ struct pmm_page {
     uint32_t flags; ///< The attributes of the page (free, occupied, etc..)
     uint32_t ref_count; ///< The number of references to the page (once it hits zero we can free it)
     uint32_t order; ///< The dimension of the page size
-    struct double_ll_node link; ///< The link to our free areas list
+    uint32_t table_entries; ///< If the page is a page table, how many of its entries are populated
+    struct double_ll_node link; ///< The link to our free areas list, or to an LRU list
+    struct vm_address_space *owner; ///< If the page is on an LRU list, the only address space that maps it
+    uint64_t vaddr; ///< If the page is on an LRU list, where the owner maps it
 };
 
+/**
+ * @brief Called on allocation failure to free memory
+ * It returns how many pages it freed
+ */
+typedef uint64_t (*pmm_reclaim_fn)(uint64_t pages);
+
 /**
  * @brief A list of physical memory region of order x
  * It provides an head to the first node and how many there are
@@ -42,10 +69,25 @@ struct free_area {
 
 void pmm_init();
 uint64_t pmm_alloc(uint64_t size);
+uint64_t pmm_alloc_atomic(uint64_t size);
+uint64_t pmm_alloc_bulk(uint64_t *pages, uint64_t count);
 void pmm_free(uint64_t physAddr, uint64_t length);
 uint64_t pmm_getHighestAddr(void);
 void pmm_page_inc_ref(uint64_t phys);
 void pmm_page_dec_ref(uint64_t phys);
+void pmm_split_page(uint64_t phys, uint32_t order);
+struct pmm_page *pmm_phys_to_page(uint64_t phys);
+uint64_t pmm_page_to_phys(struct pmm_page *page);
+uint64_t pmm_get_free_pages(void);
+uint64_t pmm_get_watermark(int wmark);
+void pmm_set_reclaimer(pmm_reclaim_fn reclaimer);
+bool pmm_reclaim_enter(void);
+void pmm_reclaim_exit(void);
+void pmm_lru_add(uint64_t phys, struct vm_address_space *owner, uint64_t vaddr);
+void pmm_lru_del(struct pmm_page *page);
+void pmm_lru_move(struct pmm_page *page, bool active);
+struct pmm_page *pmm_lru_tail(bool active);
+uint64_t pmm_lru_size(bool active);
 void pmm_dump_state(void);
 void pmm_printUsableRegions();
 
@@ -0,0 +1,37 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <devices/block.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SWAP_CLUSTER_MAX 16 ///< The most pages a single swap write or read carries
+#define SWAP_MAP_MAX 0xFFFF ///< The most references a swap slot can have
+
+/**
+ * @brief A swap area on a block device
+ * A slot holds one page, the map keeps how many swap entries reference each slot
+ */
+struct swap_area {
+    struct block_device *dev; ///< The block device, NULL if swap is off
+    uint16_t *map; ///< The reference count of each slot, 0 if the slot is free
+    uint64_t nr_slots; ///< How many slots the device holds
+    uint64_t nr_free; ///< How many slots are free
+    uint64_t next; ///< Where the search of free slots starts, so clusters are laid out in order
+    uint8_t *buffer; ///< Bounce buffer of SWAP_CLUSTER_MAX pages, the frames of a cluster aren't contiguous
+    uint64_t pages_out; ///< Pages swapped out, to the device or to the compressed cache
+    uint64_t pages_in; ///< Pages swapped in
+    uint64_t writes; ///< Write requests to the device
+    uint64_t reads; ///< Read requests to the device
+};
+
+bool swap_on(struct block_device *dev);
+bool swap_enabled(void);
+uint64_t swap_alloc(uint64_t *slot, uint64_t count);
+void swap_dup(uint64_t slot);
+void swap_free(uint64_t slot);
+bool swap_write_pages(uint64_t slot, uint64_t *frames, uint64_t count);
+bool swap_read_pages(uint64_t slot, uint64_t *frames, uint64_t count);
+void swap_print_stats(void);
+
+#endif // SWAP_H
@@ -2,7 +2,10 @@
 #define VMM_H
 
 #include <interrupts/isr.h>
+#include <memory/paging.h>
+#include <common/rbtree.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /**
  * @name VMM start/end for user/kernel 
@@ -30,18 +33,148 @@
 #define VMM_FLAGS_MMIO      (1ull << 5)     ///< Memory mapped I/O in this page
 #define VMM_FLAGS_WC        (1ull << 6)     ///< For write combine cache (useful for framebuffers)
 #define VMM_FLAGS_UC        (1ull << 7)     ///< For uncacheable pages (eg. MMIO)
+#define VMM_FLAGS_POPULATE  (1ull << 8)     ///< Map the whole area when it's allocated instead of on demand, it isn't kept in the area flags
+#define VMM_FLAGS_MERGEABLE (1ull << 9)     ///< Identical pages of the area can be merged by the same page scanner
+#define VMM_FLAGS_SEQUENTIAL (1ull << 10)   ///< Accessed sequentially, faults map the biggest window ahead of the fault
+#define VMM_FLAGS_RANDOM    (1ull << 11)    ///< Accessed randomly, faults map only the faulting page
+#define VMM_FLAGS_HUGEPAGE  (1ull << 12)    ///< Backed by huge pages even if transparent huge pages are disabled
+#define VMM_FLAGS_NOHUGEPAGE (1ull << 13)   ///< Never backed by huge pages
+#define VMM_FLAGS_NOMERGE   (1ull << 14)    ///< Never merged with the areas next to it nor split, so it stays exactly this allocation
+
+#define VMM_FLAGS_PROT_MASK (VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_EXEC) ///< The flags vmm_protect changes
+/** @} */
+
+/**
+ * @name Memory advice
+ * What vmm_advise can be told about a range, the values are the ones of madvise
+ * @{
+ */
+#define VMM_ADVICE_NORMAL       0  ///< No special treatment
+#define VMM_ADVICE_RANDOM       1  ///< Sets VMM_FLAGS_RANDOM
+#define VMM_ADVICE_SEQUENTIAL   2  ///< Sets VMM_FLAGS_SEQUENTIAL
+#define VMM_ADVICE_WILLNEED     3  ///< The range will be used soon, it's mapped in the background
+#define VMM_ADVICE_DONTNEED     4  ///< The content isn't needed, the pages are freed now and read back as zeroes
+#define VMM_ADVICE_FREE         8  ///< The content isn't needed, reclaim can free the pages until they're written again
+#define VMM_ADVICE_MERGEABLE    12 ///< Sets VMM_FLAGS_MERGEABLE
+#define VMM_ADVICE_UNMERGEABLE  13 ///< Clears VMM_FLAGS_MERGEABLE, merged pages stay shared until they're written
+#define VMM_ADVICE_HUGEPAGE     14 ///< Sets VMM_FLAGS_HUGEPAGE
+#define VMM_ADVICE_NOHUGEPAGE   15 ///< Sets VMM_FLAGS_NOHUGEPAGE, the huge pages already mapped stay
+/** @} */
+
+/**
+ * @name Transparent huge pages
+ * @{
+ */
+#define VMM_THP_COLLAPSE_MIN_PTES   256 ///< How many 4KB pages a 2MB window needs before it's collapsed
+#define VMM_THP_SCAN_WINDOWS        8   ///< How many 2MB windows a background scan examines
+#define VMM_THP_SCAN_INTERVAL_MS    100 ///< How often the background scan runs
+/** @} */
+
+/**
+ * @name Fault-around
+ * @{
+ */
+#define VMM_FAULT_AROUND_DEFAULT    16 ///< Pages mapped by a demand fault (power of 2)
+#define VMM_FAULT_AROUND_MAX        64 ///< The biggest fault-around window, also the bulk allocation size
+/** @} */
+
+#define VMM_WS_SCAN_INTERVAL_MS 1000 ///< How often the accessed and dirty bits are harvested
+
+/**
+ * @name Background prefault
+ * @{
+ */
+#define VMM_WILLNEED_QUEUE  8   ///< How many advised ranges can wait to be mapped
+#define VMM_WILLNEED_BATCH  512 ///< How many pages are mapped per idle wake up
+/** @} */
+
+/**
+ * @name Page reclaim
+ * @{
+ */
+#define VMM_RECLAIM_PRIORITY    12   ///< A reclaim pass first scans 1/2^priority of the LRU lists, then twice as much...
+#define VMM_KSWAPD_BATCH        32   ///< How many pages the background reclaim frees per idle wake up
+#define VMM_KSWAPD_BACKOFF_MS   1000 ///< How long the background reclaim sleeps after freeing nothing
+/** @} */
+
+/**
+ * @name Same page merging
+ * @{
+ */
+#define VMM_KSM_PAGES_TO_SCAN       100  ///< How many pages a background scan examines
+#define VMM_KSM_SCAN_INTERVAL_MS    20   ///< How often the background scan runs
+#define VMM_KSM_STABLE_BUCKETS      256  ///< Buckets of the merged pages hash table (power of 2)
+#define VMM_KSM_UNSTABLE_SIZE       1024 ///< Candidates remembered during a pass (power of 2)
 /** @} */
 
+/**
+ * @brief A merged page, write protected and shared by every identical page
+ * The node holds its own reference, the page is freed when it's the last one
+ */
+struct vmm_ksm_stable_node {
+    uint64_t hash; ///< The hash of the content
+    uint64_t phys; ///< The physical address of the page
+    struct vmm_ksm_stable_node *next; ///< The next node of the bucket
+};
+
+/**
+ * @brief A page seen during the current pass, not merged yet
+ * It may have changed since, it's verified before merging
+ */
+struct vmm_ksm_candidate {
+    uint64_t hash; ///< The hash of the content when it was seen
+    struct vm_address_space *space; ///< The address space, NULL if the entry is empty
+    uint64_t vaddr; ///< The address of the page
+    uint64_t phys; ///< The physical address of the page
+};
+
+/**
+ * @brief The same page merging counters
+ */
+struct vmm_ksm_stats {
+    uint64_t pages_scanned; ///< Pages hashed
+    uint64_t pages_merged; ///< Pages replaced by a merged page
+    uint64_t zero_pages_merged; ///< Pages replaced by the zero page
+    uint64_t full_scans; ///< Completed passes over the kernel and current address spaces
+};
+
+/**
+ * @brief A range advised with VMM_ADVICE_WILLNEED, waiting to be mapped
+ */
+struct vmm_willneed_range {
+    struct vm_address_space *space; ///< The address space of the range
+    uint64_t start; ///< The first address not mapped yet
+    uint64_t end; ///< The end of the range (excluded)
+};
+
+/**
+ * @brief The page reclaim counters
+ */
+struct vmm_reclaim_stats {
+    uint64_t scanned; ///< Pages examined on the inactive list
+    uint64_t reclaimed; ///< Pages freed
+    uint64_t activated; ///< Inactive pages found referenced and moved back to the active list
+    uint64_t deactivated; ///< Active pages found idle and moved to the inactive list
+    uint64_t kswapd_wakeups; ///< How many times free memory fell below the low watermark
+    uint64_t direct_reclaims; ///< How many allocations had to reclaim memory themselves
+    uint64_t swap_readahead; ///< Pages read back from swap around a swap fault
+    uint64_t lazy_freed; ///< Lazily freed pages dropped without being written to swap
+};
+
 /**
  * @brief A contiguos region of virtual memory
  * Used mainly to guide the page fault handler into
- * his decision making
+ * his decision making. The areas of an address space are kept in a red-black
+ * tree ordered by base, where each node also knows the largest free gap below it.
+ * Areas next to each other with the same flags are merged into one
  */
 struct vm_area {
     uint64_t base; ///< The starting virtual address 
     uint64_t size; ///< The length of the region
     uint64_t flags; ///< Flags that describe the type of this region
-    struct vm_area *next; ///< Pointer to the next region
+    uint64_t gap; ///< The free space between the previous area (or the start of the VAS) and this one
+    uint64_t subtree_gap; ///< The largest gap in the subtree rooted at this area
+    struct rb_node node; ///< The link into the area tree
 };
 
 /**
@@ -50,21 +183,51 @@ struct vm_area {
  */
 struct vm_address_space {
     uint64_t *pml4_phys; ///< The pointer to the pml4 table for this VAS
-    struct vm_area *region_list; ///< List of the regions
+    struct rb_root area_tree; ///< Tree of the regions, ordered by base
+    uint16_t pcid; ///< The process context identifier that tags the tlb entries of this VAS
+    uint64_t pcid_generation; ///< The pcid is valid only if it's equal to the current generation
+    struct paging_access_stats working_set; ///< The result of the last accessed and dirty scan
 };
 
 void vmm_init(void);
 
 struct vm_address_space *vmm_new_address_space(void);
 void vmm_destroy_address_space(struct vm_address_space *);
+struct vm_address_space *vmm_clone_address_space(struct vm_address_space *space);
 void vmm_switch_address_space(struct vm_address_space *space);
+void vmm_pcid_invalidate(struct vm_address_space *space);
 
 void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, uint64_t arg);
-void vmm_free(struct vm_address_space *space, uint64_t addr);
+void vmm_free(struct vm_address_space *space, uint64_t addr, uint64_t len);
+bool vmm_unmap(struct vm_address_space *space, uint64_t addr, uint64_t len);
+bool vmm_protect(struct vm_address_space *space, uint64_t addr, uint64_t len, uint64_t prot);
+struct vm_area *vmm_get_vm_area(struct vm_address_space *space, uint64_t vaddr);
+bool vmm_advise(struct vm_address_space *space, uint64_t addr, uint64_t len, int advice);
 
 struct vm_address_space* vmm_get_kernel_vas(void);
+uint64_t vmm_get_zero_page(void);
 uint64_t vmm_generic_to_x86_flags(uint64_t genericFlags);
 
 void vmm_page_fault_handler(struct isr_context *context);
 
+void vmm_dump_address_space(struct vm_address_space *space);
+
+void vmm_scan_working_set(struct vm_address_space *space);
+uint64_t vmm_get_working_set_size(struct vm_address_space *space);
+void vmm_print_working_set(struct vm_address_space *space);
+
+void vmm_set_fault_around(uint64_t pages);
+void vmm_set_transparent_huge_pages(bool enabled);
+void vmm_thp_collapse_scan(uint64_t windows);
+
+void vmm_set_ksm(bool enabled);
+void vmm_ksm_scan(uint64_t pages);
+void vmm_print_ksm_stats(void);
+
+uint64_t vmm_reclaim_pages(uint64_t pages);
+void vmm_kswapd(void);
+void vmm_print_reclaim_stats(void);
+
+void vmm_background_work(void);
+
 #endif // VMM_H
\ No newline at end of file
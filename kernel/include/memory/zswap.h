@@ -0,0 +1,62 @@
+#ifndef ZSWAP_H
+#define ZSWAP_H
+
+#include <common/dll.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ZSWAP_MAX_POOL_PERCENT  20   ///< The pool can grow up to this percentage of the free memory at swap on
+#define ZSWAP_CLASS_GRANULARITY 64   ///< The objects are rounded up to a multiple of this size
+#define ZSWAP_MAX_OBJECT_SIZE   3072 ///< Pages that don't compress below this (with the object header) go to the device
+#define ZSWAP_NR_CLASSES        (ZSWAP_MAX_OBJECT_SIZE / ZSWAP_CLASS_GRANULARITY)
+#define ZSWAP_MAX_ZSPAGE_ORDER  2    ///< A zspage is made of up to 2^ZSWAP_MAX_ZSPAGE_ORDER contiguous pages
+#define ZSWAP_HANDLE_INDEX_MASK 0xFFF ///< The low bits of a handle are the object index, the others the zspage address
+
+/**
+ * @brief The header of a zspage, a physical block holding objects of a single size class
+ * It sits at the start of the block, the objects follow at ZSWAP_CLASS_GRANULARITY.
+ * The free objects are chained through their first 2 bytes
+ */
+struct zswap_zspage {
+    struct double_ll_node link; ///< The link into the partial list of the class
+    uint16_t class_index; ///< The size class of the objects
+    uint16_t used; ///< How many objects are allocated
+    uint16_t free_head; ///< The first free object, capacity if there's none
+    uint16_t padding;
+};
+
+/**
+ * @brief A size class of the compressed object allocator
+ */
+struct zswap_class {
+    uint32_t size; ///< The object size
+    uint32_t order; ///< The zspages of this class are 2^order pages
+    uint32_t capacity; ///< How many objects a zspage holds
+    struct double_ll_node partial; ///< The zspages with free objects
+};
+
+/**
+ * @brief The compressed store counters
+ * The cycles are read with the tsc around the compressor and the decompressor
+ */
+struct zswap_stats {
+    uint64_t stored_pages; ///< Pages currently in the pool
+    uint64_t pool_pages; ///< Physical pages used by the pool
+    uint64_t compressed_bytes; ///< Compressed size of the stored pages
+    uint64_t stores; ///< Successful stores
+    uint64_t loads; ///< Successful loads
+    uint64_t rejected_incompressible; ///< Pages that didn't compress enough
+    uint64_t rejected_pool_full; ///< Pages that didn't fit in the pool
+    uint64_t compress_cycles; ///< Tsc cycles spent compressing, rejected pages included
+    uint64_t compress_calls; ///< Calls to the compressor
+    uint64_t decompress_cycles; ///< Tsc cycles spent decompressing
+};
+
+bool zswap_init(uint64_t nr_slots);
+bool zswap_store(uint64_t slot, uint64_t phys);
+bool zswap_load(uint64_t slot, uint64_t phys);
+bool zswap_stored(uint64_t slot);
+void zswap_invalidate(uint64_t slot);
+void zswap_print_stats(void);
+
+#endif // ZSWAP_H
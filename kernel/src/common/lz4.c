@@ -0,0 +1,231 @@
+#include <common/lz4.h>
+#include <libk/string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A compressor and a decompressor for the LZ4 block format.
+// A block is a list of sequences: a token (4 bits of literal length, 4 bits of
+// match length - 4), the extra literal length bytes, the literals, a 16 bit
+// little endian offset and the extra match length bytes. The last sequence has
+// only literals. Lengths of 15 continue in the next bytes, 255 means keep adding
+
+/**
+ * @brief Reads 4 bytes from an unaligned address
+ * 
+ * @param p The address
+ * @return uint32_t The bytes
+ */
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Hashes 4 bytes into the position table
+ * 
+ * @param sequence The bytes
+ * @return uint32_t The index in the table
+ */
+static inline uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * @brief Writes a length that doesn't fit in its token nibble
+ * 
+ * @param op Where to write
+ * @param len The length minus 15
+ * @return uint8_t* The address after the length
+ */
+static inline uint8_t *lz4_write_length(uint8_t *op, size_t len)
+{
+    while(len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * @brief Writes a sequence
+ * 
+ * @param op Where to write
+ * @param op_end The end of the output
+ * @param literals The literals
+ * @param lit_len How many literals
+ * @param offset The match offset, 0 for the last sequence
+ * @param match_len The match length, ignored for the last sequence
+ * @return uint8_t* The address after the sequence, NULL if the output is too small
+ */
+static uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *literals, size_t lit_len, size_t offset, size_t match_len)
+{
+    // The worst case size of the sequence
+    size_t needed = 1 + lit_len / 255 + 1 + lit_len + (offset ? 2 + match_len / 255 + 1 : 0);
+    if((size_t)(op_end - op) < needed) return NULL;
+
+    uint8_t *token = op++;
+    *token = 0;
+
+    if(lit_len >= 15)
+    {
+        *token = 15 << 4;
+        op = lz4_write_length(op, lit_len - 15);
+    }
+    else
+    {
+        *token = lit_len << 4;
+    }
+
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if(!offset) return op;
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    match_len -= LZ4_MIN_MATCH;
+    if(match_len >= 15)
+    {
+        *token |= 15;
+        op = lz4_write_length(op, match_len - 15);
+    }
+    else
+    {
+        *token |= match_len;
+    }
+
+    return op;
+}
+
+/**
+ * @brief Compresses a buffer
+ * A greedy single pass over the input, each position is looked up in a hash
+ * table of the last positions where the same 4 bytes were seen
+ * @param src The input
+ * @param src_len The input size, at most LZ4_MAX_INPUT
+ * @param dst The output
+ * @param dst_cap The output size, compression fails if it doesn't fit
+ * @param table A workspace of LZ4_HASH_SIZE entries
+ * @return size_t The compressed size, 0 if it doesn't fit in dst_cap
+ */
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap, uint16_t *table)
+{
+    if(src_len > LZ4_MAX_INPUT) return 0;
+
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_cap;
+    size_t anchor = 0;
+
+    if(src_len > LZ4_MFLIMIT)
+    {
+        // Position 0 is a valid default, every candidate is verified anyway
+        memset(table, 0x00, LZ4_HASH_SIZE * sizeof(uint16_t));
+
+        size_t match_limit = src_len - LZ4_LAST_LITERALS;
+        size_t ip = 0;
+        while(ip < src_len - LZ4_MFLIMIT)
+        {
+            uint32_t sequence = lz4_read32(src + ip);
+            uint32_t hash = lz4_hash(sequence);
+            size_t ref = table[hash];
+            table[hash] = ip;
+
+            if(ref >= ip || lz4_read32(src + ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            size_t match_len = LZ4_MIN_MATCH;
+            while(ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len]) match_len++;
+
+            op = lz4_write_sequence(op, op_end, src + anchor, ip - anchor, ip - ref, match_len);
+            if(!op) return 0;
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_write_sequence(op, op_end, src + anchor, src_len - anchor, 0, 0);
+    if(!op) return 0;
+
+    return op - dst;
+}
+
+/**
+ * @brief Reads a length that doesn't fit in its token nibble
+ * 
+ * @param ip The input position, it's advanced
+ * @param ip_end The end of the input
+ * @param len The length to increment
+ * @return true if the length was read, false if the input is truncated
+ */
+static inline bool lz4_read_length(const uint8_t **ip, const uint8_t *ip_end, size_t *len)
+{
+    uint8_t byte;
+    do
+    {
+        if(*ip >= ip_end) return false;
+        byte = *(*ip)++;
+        *len += byte;
+    } while(byte == 255);
+
+    return true;
+}
+
+/**
+ * @brief Decompresses a buffer
+ * Every length and offset is checked, a corrupted input can't write out of dst
+ * @param src The compressed input
+ * @param src_len The compressed size
+ * @param dst The output
+ * @param dst_cap The output size
+ * @return size_t The decompressed size, 0 if the input is corrupted or doesn't fit
+ */
+size_t lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_cap;
+
+    while(ip < ip_end)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if(lit_len == 15 && !lz4_read_length(&ip, ip_end, &lit_len)) return 0;
+        if(lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) return 0;
+
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // The last sequence has no match
+        if(ip == ip_end) break;
+
+        if(ip_end - ip < 2) return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(!offset || offset > (size_t)(op - dst)) return 0;
+
+        size_t match_len = token & 15;
+        if(match_len == 15 && !lz4_read_length(&ip, ip_end, &match_len)) return 0;
+        match_len += LZ4_MIN_MATCH;
+        if(match_len > (size_t)(op_end - op)) return 0;
+
+        // The match can overlap the output, byte by byte repeats the pattern
+        const uint8_t *match = op - offset;
+        while(match_len--) *op++ = *match++;
+    }
+
+    return op - dst;
+}
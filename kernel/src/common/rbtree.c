@@ -0,0 +1,390 @@
+#include <common/rbtree.h>
+#include <stddef.h>
+
+// An intrusive red-black tree. The caller does the search and links the node,
+// the tree only keeps itself balanced. An optional augment callback keeps a
+// per subtree value (eg. a maximum) up to date across rotations
+
+/**
+ * @brief Replaces a child of a node (or the root) with another node
+ * 
+ * @param root The root of the tree
+ * @param parent The parent of old, NULL if old is the root
+ * @param old The current child
+ * @param new The node that takes its place
+ */
+static inline void rb_replace_child(struct rb_root *root, struct rb_node *parent, struct rb_node *old, struct rb_node *new)
+{
+    if(!parent)
+        root->node = new;
+    else if(parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+/**
+ * @brief Rotates a node to the left, its right child takes its place
+ * The subtree holds the same nodes afterwards, so the ancestors keep their augmented value
+ * @param root The root of the tree
+ * @param node The node to rotate
+ * @param augment The augment callback, can be NULL
+ */
+static void rb_rotate_left(struct rb_root *root, struct rb_node *node, rb_augment_fn augment)
+{
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if(right->left) right->left->parent = node;
+
+    right->parent = node->parent;
+    rb_replace_child(root, node->parent, node, right);
+
+    right->left = node;
+    node->parent = right;
+
+    if(augment)
+    {
+        augment(node);
+        augment(right);
+    }
+}
+
+/**
+ * @brief Rotates a node to the right, its left child takes its place
+ * The subtree holds the same nodes afterwards, so the ancestors keep their augmented value
+ * @param root The root of the tree
+ * @param node The node to rotate
+ * @param augment The augment callback, can be NULL
+ */
+static void rb_rotate_right(struct rb_root *root, struct rb_node *node, rb_augment_fn augment)
+{
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if(left->right) left->right->parent = node;
+
+    left->parent = node->parent;
+    rb_replace_child(root, node->parent, node, left);
+
+    left->right = node;
+    node->parent = left;
+
+    if(augment)
+    {
+        augment(node);
+        augment(left);
+    }
+}
+
+/**
+ * @brief Recomputes the augmented value from a node up to the root
+ * 
+ * @param node The lowest node whose subtree changed
+ * @param augment The augment callback
+ */
+void rb_augment_propagate(struct rb_node *node, rb_augment_fn augment)
+{
+    for(; node != NULL; node = node->parent)
+    {
+        augment(node);
+    }
+}
+
+/**
+ * @brief Links a new node where the search for its key ended
+ * 
+ * @param node The new node
+ * @param parent The last node visited by the search
+ * @param link The child pointer of parent (or the root pointer) where the search ended
+ * @note It must be followed by rb_insert_color
+ */
+void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+
+    *link = node;
+}
+
+/**
+ * @brief Rebalances the tree after a node was linked
+ * 
+ * @param node The node just linked
+ * @param root The root of the tree
+ * @param augment The augment callback, can be NULL
+ */
+void rb_insert_color(struct rb_node *node, struct rb_root *root, rb_augment_fn augment)
+{
+    if(augment) rb_augment_propagate(node, augment);
+
+    // A red parent isn't the root, so the grandparent exists
+    while(node != root->node && node->parent->color == RB_RED)
+    {
+        struct rb_node *parent = node->parent;
+        struct rb_node *gparent = parent->parent;
+
+        if(parent == gparent->left)
+        {
+            struct rb_node *uncle = gparent->right;
+            if(uncle && uncle->color == RB_RED)
+            {
+                // Push the blackness down from the grandparent
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if(node == parent->right)
+            {
+                rb_rotate_left(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(root, gparent, augment);
+        }
+        else
+        {
+            struct rb_node *uncle = gparent->left;
+            if(uncle && uncle->color == RB_RED)
+            {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if(node == parent->left)
+            {
+                rb_rotate_right(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(root, gparent, augment);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/**
+ * @brief Restores the black height after a black node was removed
+ * 
+ * @param root The root of the tree
+ * @param node The node that took the place of the removed one (can be NULL)
+ * @param parent The parent of node
+ * @param augment The augment callback, can be NULL
+ */
+static void rb_erase_color(struct rb_root *root, struct rb_node *node, struct rb_node *parent, rb_augment_fn augment)
+{
+    while(node != root->node && (!node || node->color == RB_BLACK))
+    {
+        // The sibling exists, its subtree has one more black node
+        if(node == parent->left)
+        {
+            struct rb_node *sibling = parent->right;
+            if(sibling->color == RB_RED)
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(root, parent, augment);
+                sibling = parent->right;
+            }
+
+            if((!sibling->left || sibling->left->color == RB_BLACK) && (!sibling->right || sibling->right->color == RB_BLACK))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if(!sibling->right || sibling->right->color == RB_BLACK)
+            {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_right(root, sibling, augment);
+                sibling = parent->right;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rb_rotate_left(root, parent, augment);
+            node = root->node;
+        }
+        else
+        {
+            struct rb_node *sibling = parent->left;
+            if(sibling->color == RB_RED)
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(root, parent, augment);
+                sibling = parent->left;
+            }
+
+            if((!sibling->left || sibling->left->color == RB_BLACK) && (!sibling->right || sibling->right->color == RB_BLACK))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if(!sibling->left || sibling->left->color == RB_BLACK)
+            {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_left(root, sibling, augment);
+                sibling = parent->left;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rb_rotate_right(root, parent, augment);
+            node = root->node;
+        }
+    }
+
+    if(node) node->color = RB_BLACK;
+}
+
+/**
+ * @brief Removes a node from the tree
+ * 
+ * @param node The node to remove
+ * @param root The root of the tree
+ * @param augment The augment callback, can be NULL
+ */
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_fn augment)
+{
+    struct rb_node *child, *parent;
+    int color;
+
+    if(!node->left || !node->right)
+    {
+        // At most one child, it takes the place of the node
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if(child) child->parent = parent;
+        rb_replace_child(root, parent, node, child);
+    }
+    else
+    {
+        // Two children, the successor takes the place of the node
+        struct rb_node *successor = node->right;
+        while(successor->left) successor = successor->left;
+
+        child = successor->right;
+        color = successor->color;
+
+        if(successor->parent == node)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = successor->parent;
+            parent->left = child;
+            if(child) child->parent = parent;
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->color = node->color;
+        rb_replace_child(root, node->parent, node, successor);
+    }
+
+    if(augment) rb_augment_propagate(parent, augment);
+
+    if(color == RB_BLACK) rb_erase_color(root, child, parent, augment);
+}
+
+/**
+ * @brief Returns the node with the smallest key
+ * 
+ * @param root The root of the tree
+ * @return struct rb_node* The first node, NULL if the tree is empty
+ */
+struct rb_node *rb_first(struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+    if(!node) return NULL;
+
+    while(node->left) node = node->left;
+    return node;
+}
+
+/**
+ * @brief Returns the node with the biggest key
+ * 
+ * @param root The root of the tree
+ * @return struct rb_node* The last node, NULL if the tree is empty
+ */
+struct rb_node *rb_last(struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+    if(!node) return NULL;
+
+    while(node->right) node = node->right;
+    return node;
+}
+
+/**
+ * @brief Returns the in-order successor of a node
+ * 
+ * @param node The current node
+ * @return struct rb_node* The next node, NULL if node is the last one
+ */
+struct rb_node *rb_next(struct rb_node *node)
+{
+    if(node->right)
+    {
+        node = node->right;
+        while(node->left) node = node->left;
+        return node;
+    }
+
+    // Go up until we come from a left subtree
+    while(node->parent && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
+
+/**
+ * @brief Returns the in-order predecessor of a node
+ * 
+ * @param node The current node
+ * @return struct rb_node* The previous node, NULL if node is the first one
+ */
+struct rb_node *rb_prev(struct rb_node *node)
+{
+    if(node->left)
+    {
+        node = node->left;
+        while(node->right) node = node->right;
+        return node;
+    }
+
+    // Go up until we come from a right subtree
+    while(node->parent && node == node->parent->left) node = node->parent;
+    return node->parent;
+}
@@ -56,6 +56,30 @@ void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, ui
     if (edx) *edx = rdx;
 }
 
+inline uint64_t read_cr0() 
+{
+    uint64_t val;
+    asm volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+inline void write_cr0(uint64_t val) 
+{
+    asm volatile("mov %0, %%cr0" :: "r"(val));
+}
+
+inline uint64_t read_cr3() 
+{
+    uint64_t val;
+    asm volatile("mov %%cr3, %0" : "=r"(val));
+    return val;
+}
+
+inline void write_cr3(uint64_t val) 
+{
+    asm volatile("mov %0, %%cr3" :: "r"(val) : "memory");
+}
+
 inline uint64_t read_cr4() 
 {
     uint64_t val;
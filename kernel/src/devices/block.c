@@ -0,0 +1,56 @@
+#include <common/logging.h>
+#include <devices/block.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Checks that a request is inside the device
+ * 
+ * @param dev The block device
+ * @param lba The first sector
+ * @param count How many sectors
+ * @return true if the request is valid
+ */
+static bool block_check_range(struct block_device *dev, uint64_t lba, uint64_t count)
+{
+    if(!dev || lba >= dev->sector_count || count > dev->sector_count - lba)
+    {
+        log_line(LOG_WARN, "%s: Request of %llu sectors at %llu is out of %s", __FUNCTION__, count, lba, dev ? dev->name : "(null)");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Reads sectors from a block device
+ * 
+ * @param dev The block device
+ * @param lba The first sector
+ * @param count How many sectors
+ * @param buffer Where to store them, at least count * sector_size bytes
+ * @return true if the read succeeded
+ */
+bool block_read(struct block_device *dev, uint64_t lba, uint64_t count, void *buffer)
+{
+    if(!block_check_range(dev, lba, count)) return false;
+
+    return dev->read(dev, lba, count, buffer);
+}
+
+/**
+ * @brief Writes sectors to a block device
+ * 
+ * @param dev The block device
+ * @param lba The first sector
+ * @param count How many sectors
+ * @param buffer The data, count * sector_size bytes
+ * @return true if the write succeeded
+ */
+bool block_write(struct block_device *dev, uint64_t lba, uint64_t count, const void *buffer)
+{
+    if(!block_check_range(dev, lba, count)) return false;
+
+    return dev->write(dev, lba, count, buffer);
+}
@@ -115,6 +115,28 @@ uint64_t timer_get_uptime_ms()
     return system_ticks * (1000 / TIMER_FREQUENCY_HZ);
 }
 
+/**
+ * @brief Reads the TSC, to time short operations
+ * 
+ * @return uint64_t The current TSC value
+ */
+uint64_t timer_get_tsc(void)
+{
+    return rdtsc();
+}
+
+/**
+ * @brief Converts TSC cycles to nanoseconds
+ * 
+ * @param cycles The cycles
+ * @return uint64_t The nanoseconds, 0 before the TSC is calibrated
+ */
+uint64_t timer_tsc_to_ns(uint64_t cycles)
+{
+    if(tsc_freq_hz < 1000000) return 0;
+    return cycles * 1000 / (tsc_freq_hz / 1000000);
+}
+
 void timer_handler(void)
 {
     system_ticks++;
@@ -0,0 +1,114 @@
+#include <common/logging.h>
+#include <drivers/ramdisk.h>
+#include <libk/string.h>
+#include <memory/hhdm.h>
+#include <memory/kheap.h>
+#include <memory/pmm.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Copies between a buffer and the ramdisk storage
+ * 
+ * @param disk The ramdisk
+ * @param offset The byte offset in the storage
+ * @param buffer The buffer
+ * @param size How many bytes to copy
+ * @param write true to copy from the buffer to the storage
+ */
+static void ramdisk_copy(struct ramdisk *disk, uint64_t offset, uint8_t *buffer, uint64_t size, bool write)
+{
+    while(size)
+    {
+        // A copy can't cross a storage block
+        uint64_t chunk_offset = offset % RAMDISK_CHUNK_SIZE;
+        uint64_t len = RAMDISK_CHUNK_SIZE - chunk_offset;
+        if(len > size) len = size;
+
+        uint8_t *storage = (uint8_t *)hhdm_physToVirt((void *)disk->chunks[offset / RAMDISK_CHUNK_SIZE]) + chunk_offset;
+        if(write)
+            memcpy(storage, buffer, len);
+        else
+            memcpy(buffer, storage, len);
+
+        offset += len;
+        buffer += len;
+        size -= len;
+    }
+}
+
+/**
+ * @brief The read operation of the ramdisk
+ * 
+ * @param dev The block device of the ramdisk
+ * @param lba The first sector
+ * @param count How many sectors
+ * @param buffer Where to store them
+ * @return true, a ramdisk can't fail
+ */
+static bool ramdisk_read(struct block_device *dev, uint64_t lba, uint64_t count, void *buffer)
+{
+    ramdisk_copy((struct ramdisk *)dev, lba * dev->sector_size, buffer, count * dev->sector_size, false);
+    return true;
+}
+
+/**
+ * @brief The write operation of the ramdisk
+ * 
+ * @param dev The block device of the ramdisk
+ * @param lba The first sector
+ * @param count How many sectors
+ * @param buffer The data
+ * @return true, a ramdisk can't fail
+ */
+static bool ramdisk_write(struct block_device *dev, uint64_t lba, uint64_t count, const void *buffer)
+{
+    ramdisk_copy((struct ramdisk *)dev, lba * dev->sector_size, (uint8_t *)buffer, count * dev->sector_size, true);
+    return true;
+}
+
+/**
+ * @brief Creates a ramdisk
+ * 
+ * @param name The name of the device
+ * @param size The size in bytes, rounded up to RAMDISK_CHUNK_SIZE
+ * @return struct block_device* The block device, NULL if there isn't enough memory
+ */
+struct block_device *ramdisk_create(const char *name, uint64_t size)
+{
+    struct ramdisk *disk = kzalloc(sizeof(struct ramdisk));
+    if(!disk) return NULL;
+
+    disk->nr_chunks = (size + RAMDISK_CHUNK_SIZE - 1) / RAMDISK_CHUNK_SIZE;
+    disk->chunks = kzalloc(disk->nr_chunks * sizeof(uint64_t));
+    if(!disk->chunks)
+    {
+        kfree(disk);
+        return NULL;
+    }
+
+    for(uint64_t i = 0; i < disk->nr_chunks; i++)
+    {
+        disk->chunks[i] = pmm_alloc(RAMDISK_CHUNK_SIZE);
+        if(!disk->chunks[i])
+        {
+            log_line(LOG_WARN, "%s: Not enough memory for a %llu bytes ramdisk", __FUNCTION__, size);
+
+            while(i--) pmm_free(disk->chunks[i], RAMDISK_CHUNK_SIZE);
+            kfree(disk->chunks);
+            kfree(disk);
+            return NULL;
+        }
+    }
+
+    disk->dev.name = name;
+    disk->dev.sector_size = BLOCK_SECTOR_SIZE;
+    disk->dev.sector_count = disk->nr_chunks * RAMDISK_CHUNK_SIZE / BLOCK_SECTOR_SIZE;
+    disk->dev.read = ramdisk_read;
+    disk->dev.write = ramdisk_write;
+    disk->dev.data = NULL;
+
+    log_line(LOG_SUCCESS, "%s: %s, %llu KB", __FUNCTION__, name, disk->nr_chunks * RAMDISK_CHUNK_SIZE / 1024);
+    return &disk->dev;
+}
@@ -1,6 +1,7 @@
 #include <devices/timer.h>
 #include <drivers/console.h>
 #include <drivers/lapic.h>
+#include <drivers/ramdisk.h>
 #include <flanterm.h>
 #include <memory/kheap.h>
 #include <memory/paging.h>
@@ -13,6 +14,7 @@
 #include <interrupts/idt.h>
 #include <drivers/serial.h>
 #include <memory/pmm.h>
+#include <memory/swap.h>
 #include <libk/string.h>
 #include <common/logging.h>
 #include <limine_requests.h>
@@ -50,8 +52,17 @@ void kmain(void) {
 
     timer_init();
 
+#ifdef RAMDISK_SWAP_MB
+    // A ramdisk takes memory instead of giving it, it's only useful for testing
+    swap_on(ramdisk_create("ram0", RAMDISK_SWAP_MB * 1024ull * 1024ull));
+#endif
+
     asm volatile ("sti");
 
-    // We're done, just hang...
-    hcf();
+    // We're done, the idle loop does the background memory work between interrupts
+    for(;;)
+    {
+        vmm_background_work();
+        asm volatile("hlt");
+    }
 }
@@ -2,8 +2,11 @@
 #include <cpu.h>
 #include <memory/hhdm.h>
 #include <memory/kheap.h>
+#include <memory/kheap_prof.h>
 #include <memory/pmm.h>
 #include <memory/paging.h>
+#include <memory/vmm.h>
+#include <libk/string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -13,6 +16,8 @@
 static uint64_t kheap_start, kheap_end;
 static struct kheap_node *kheap_head;
 
+static void kheap_free(void *ptr);
+
 /**
  * @brief This function will initialize the kernel heap
  * The kernel heap is placed after the kernel, using the remainig space on the VAS
@@ -106,15 +111,166 @@ bool kheap_extend(size_t size)
 }
 
 /**
- * @brief kernel heap allocating function
- * It allocates a virtually contiguos memory region 
- * above the mapping of the kernel
- * not guaranteed to be physically contiguos
+ * @brief Gives back to the pmm the free memory of the last node
+ * 
+ * @param last The last node of the heap, can be NULL
+ */
+static void kheap_trim_tail(struct kheap_node *last)
+{
+    // Only a free tail can be given back
+    if(last == NULL || !last->isFree || last->size < KHEAP_TRIM_THRESHOLD) return;
+
+    // The new end keeps some slack and it's page aligned
+    uint64_t new_end = (uint64_t)(last + 1) + KHEAP_TRIM_RETAIN;
+    if(new_end % PAGING_PAGE_SIZE) new_end += PAGING_PAGE_SIZE - (new_end % PAGING_PAGE_SIZE);
+    if(new_end < kheap_start + KHEAP_STARTING_SIZE) new_end = kheap_start + KHEAP_STARTING_SIZE;
+    if(new_end >= kheap_end) return;
+
+    uint64_t released = kheap_end - new_end;
+
+    // Unmap the pages and free the physical memory
+    paging_unmap_region(hhdm_physToVirt(paging_getKernelRoot()), new_end, released, false, true);
+
+    last->size -= released;
+    kheap_end = new_end;
+
+    log_line(LOG_DEBUG, "%s: The heap has been trimmed by %llu bytes; new kheap_end = %llx", __FUNCTION__, released, kheap_end);
+}
+
+/**
+ * @brief Gives back to the pmm the free memory at the tail of the heap
+ * It's done with hysteresis: we only trim when the free tail is bigger than
+ * KHEAP_TRIM_THRESHOLD and we always keep KHEAP_TRIM_RETAIN bytes of it,
+ * so an allocation burst right after a trim doesn't need to extend again
+ * @note The heap never shrinks below KHEAP_STARTING_SIZE
+ */
+void kheap_trim(void)
+{
+    // Get the last node
+    struct kheap_node *last = kheap_head;
+    while(last != NULL && last->next != NULL)
+    {
+        last = last->next;
+    }
+
+    kheap_trim_tail(last);
+}
+
+/**
+ * @brief Splits a node in two if the remaining size is enough for another block
+ * The second node is set as free, the first one keeps its state
+ * @param node The node to split
+ * @param size The new size of node, already aligned to KHEAP_BLOCK_SIZE
+ */
+static void kheap_split(struct kheap_node *node, size_t size)
+{
+    // If the remaining size is enough for another big enough block we split it
+    if(node->size - size < sizeof(struct kheap_node) + KHEAP_MIN_SPLITTING_SIZE) return;
+
+    struct kheap_node *newNode = (struct kheap_node *)((uint8_t *)node + sizeof(struct kheap_node) + size);
+
+    // Change the next node for both nodes
+    newNode->next = node->next;
+    node->next = newNode;
+
+    // Set the new node as free
+    newNode->isFree = true;
+
+    // Set both sizes accordingly
+    newNode->size = node->size - size - sizeof(struct kheap_node);
+    node->size = size;
+}
+
+/**
+ * @brief Tells if a pointer was returned by the large allocation path
+ * 
+ * @param ptr The pointer returned by kmalloc
+ * @return true if it lives in the vmm kernel area
+ * @return false if it lives in the linked list heap
+ */
+static inline bool kheap_is_large(void *ptr)
+{
+    return (uint64_t)ptr >= VMM_KERNEL_START && (uint64_t)ptr <= VMM_KERNEL_END;
+}
+
+#ifdef KHEAP_PROFILER
+/**
+ * @brief Reports a new allocation to the heap profiler
+ * 
+ * @param ptr The allocated region (NULL is ignored)
+ * @param size The requested size
+ * @param caller The return address of the public allocating function
+ */
+static void kheap_prof_track(void *ptr, size_t size, uint64_t caller)
+{
+    if(!ptr) return;
+
+    if(kheap_is_large(ptr))
+    {
+        kheap_prof_large_set(ptr, size, kheap_prof_alloc(caller, size));
+        return;
+    }
+
+    struct kheap_node *node = (struct kheap_node *)ptr - 1;
+    node->prof_site = kheap_prof_alloc(caller, node->size);
+}
+
+/**
+ * @brief Reports to the heap profiler that an allocation is going away
+ * 
+ * @param ptr The allocated region (NULL is ignored)
+ */
+static void kheap_prof_untrack(void *ptr)
+{
+    if(!ptr) return;
+
+    if(kheap_is_large(ptr))
+    {
+        kheap_prof_large_take(ptr);
+        return;
+    }
+
+    struct kheap_node *node = (struct kheap_node *)ptr - 1;
+    kheap_prof_free(node->prof_site, node->size);
+    node->prof_site = 0;
+}
+#else
+static inline void kheap_prof_track(void *ptr, size_t size, uint64_t caller) { (void)ptr; (void)size; (void)caller; }
+static inline void kheap_prof_untrack(void *ptr) { (void)ptr; }
+#endif
+
+/**
+ * @brief Allocates a big region directly from the vmm
+ * The region is page granular and lives in the vmm kernel area,
+ * so it doesn't fragment the heap or make its list longer.
+ * The pages are demand paged like any other anonymous vmm area
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A page aligned virtual address or NULL
+ */
+static void* kheap_large_alloc(size_t size)
+{
+    void *ptr = vmm_alloc(vmm_get_kernel_vas(), size, VMM_FLAGS_READ | VMM_FLAGS_WRITE | VMM_FLAGS_NOMERGE, 0);
+    if(!ptr)
+    {
+        log_line(LOG_WARN, "%s: Cannot allocate %llu bytes", __FUNCTION__, size);
+    }
+    return ptr;
+}
+
+/**
+ * @brief The allocator behind kmalloc, it isn't seen by the profiler
+ * 
  * @param size The minimum bytes that need to be reserved
  * @return void* A virtual address pointing to the reserved region
  */
-void* kmalloc(size_t size)
+static void* kheap_malloc(size_t size)
 {
+    // Big requests get their own pages
+    if(size >= KHEAP_LARGE_THRESHOLD && vmm_get_kernel_vas())
+    {
+        return kheap_large_alloc(size);
+    }
+
     // Align the size to 16 bytes
     if(size % KHEAP_BLOCK_SIZE) size += KHEAP_BLOCK_SIZE - (size % KHEAP_BLOCK_SIZE);
 
@@ -130,22 +286,7 @@ void* kmalloc(size_t size)
             // We found a free and big enough block
             if(currentNode->isFree && currentNode->size >= size)
             {
-                // If the remaining size is enough for another big enough block we split it
-                if(currentNode->size - size >= sizeof(struct kheap_node) + KHEAP_MIN_SPLITTING_SIZE)
-                {
-                    struct kheap_node *newNode = (struct kheap_node *)((uint8_t *)currentNode + sizeof(struct kheap_node) + size);
-                
-                    // Change the next node for both nodes
-                    newNode->next = currentNode->next;
-                    currentNode->next = newNode;
-
-                    // Set the new node as free and the old one as occupied
-                    newNode->isFree = true;               
-
-                    // Set both sizes accordingly
-                    newNode->size = currentNode->size - size - sizeof(struct kheap_node);
-                    currentNode->size = size;
-                }
+                kheap_split(currentNode, size);
 
                 currentNode->isFree = false;
                 return (void *)(currentNode + 1);
@@ -163,6 +304,310 @@ void* kmalloc(size_t size)
     }
 }
 
+/**
+ * @brief kernel heap allocating function
+ * It allocates a virtually contiguos memory region 
+ * above the mapping of the kernel
+ * not guaranteed to be physically contiguos
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A virtual address pointing to the reserved region
+ * @note Requests of at least KHEAP_LARGE_THRESHOLD bytes are served by the vmm
+ * (once it's initialized) and are page aligned
+ */
+void* kmalloc(size_t size)
+{
+    void *ptr = kheap_malloc(size);
+    kheap_prof_track(ptr, size, (uint64_t)__builtin_return_address(0));
+    return ptr;
+}
+
+/**
+ * @brief The allocator behind kmalloc_aligned, it isn't seen by the profiler
+ * 
+ * @param size The minimum bytes that need to be reserved
+ * @param align The alignment in bytes, it has to be a power of 2
+ * @return void* A virtual address aligned to align or NULL
+ */
+static void* kheap_malloc_aligned(size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1))) return NULL;
+
+    // Every region is already aligned to KHEAP_BLOCK_SIZE
+    if(align <= KHEAP_BLOCK_SIZE) return kheap_malloc(size);
+
+    // Large allocations are page aligned
+    if(size >= KHEAP_LARGE_THRESHOLD && align <= PAGING_PAGE_SIZE && vmm_get_kernel_vas())
+    {
+        return kheap_large_alloc(size);
+    }
+
+    // Align the size to 16 bytes
+    if(size % KHEAP_BLOCK_SIZE) size += KHEAP_BLOCK_SIZE - (size % KHEAP_BLOCK_SIZE);
+
+    while(true)
+    {
+        for(struct kheap_node *currentNode = kheap_head; currentNode != NULL; currentNode = currentNode->next)
+        {
+            if(!currentNode->isFree) continue;
+
+            uint64_t data = (uint64_t)(currentNode + 1);
+            uint64_t aligned = data;
+            if(aligned % align) aligned += align - (aligned % align);
+
+            // If we're not aligned the gap in front of us must fit a free node
+            if(aligned != data && aligned - data < sizeof(struct kheap_node) + KHEAP_MIN_SPLITTING_SIZE)
+            {
+                aligned = data + sizeof(struct kheap_node) + KHEAP_MIN_SPLITTING_SIZE;
+                if(aligned % align) aligned += align - (aligned % align);
+            }
+
+            // Is the block big enough?
+            if(aligned + size > data + currentNode->size) continue;
+
+            if(aligned != data)
+            {
+                // The gap in front stays free, the aligned part becomes a new node
+                struct kheap_node *alignedNode = (struct kheap_node *)aligned - 1;
+                alignedNode->size = data + currentNode->size - aligned;
+                alignedNode->next = currentNode->next;
+                alignedNode->isFree = true;
+
+                currentNode->size = (uint64_t)alignedNode - data;
+                currentNode->next = alignedNode;
+                currentNode = alignedNode;
+            }
+
+            kheap_split(currentNode, size);
+            currentNode->isFree = false;
+            return (void *)aligned;
+        }
+
+        // If we're here it's because we didn't find a big enough block
+        size_t needed = size + align + sizeof(struct kheap_node);
+        if(!kheap_extend(needed > KHEAP_EXTENDING_AMOUNT ? needed : KHEAP_EXTENDING_AMOUNT))
+        {
+            // The heap expansion has failed
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Allocates a memory region aligned to a given boundary
+ * Useful for cache line aligned structures (eg. per cpu data)
+ * or for page aligned buffers
+ * @param size The minimum bytes that need to be reserved
+ * @param align The alignment in bytes, it has to be a power of 2
+ * @return void* A virtual address aligned to align or NULL
+ * @note The region is freed with kfree, krealloc may move it to a less aligned address
+ */
+void* kmalloc_aligned(size_t size, size_t align)
+{
+    void *ptr = kheap_malloc_aligned(size, align);
+    kheap_prof_track(ptr, size, (uint64_t)__builtin_return_address(0));
+    return ptr;
+}
+
+/**
+ * @brief Allocates a physically contiguos memory region
+ * The memory comes straight from the pmm and it's accessed through the hhdm,
+ * so it's suitable for device descriptors and DMA buffers
+ * @param size The minimum bytes that need to be reserved (at most 2^(PMM_MAX_ORDER - 1) pages)
+ * @param phys If not NULL it's set to the physical address of the region
+ * @return void* The hhdm virtual address of the region or NULL
+ * @note The region is aligned to its size rounded up to a power of 2 pages, it isn't zeroed
+ * and it must be freed with kfree_contig
+ */
+void* kmalloc_contig(size_t size, uint64_t *phys)
+{
+    uint64_t physAddr = pmm_alloc(size);
+    if(!physAddr) return NULL;
+
+    if(phys) *phys = physAddr;
+    return hhdm_physToVirt((void *)physAddr);
+}
+
+/**
+ * @brief Frees a region returned by kmalloc_contig
+ * 
+ * @param ptr The hhdm virtual address returned by kmalloc_contig
+ */
+void kfree_contig(void *ptr)
+{
+    if(!ptr) return;
+    pmm_page_dec_ref((uint64_t)hhdm_virtToPhys(ptr));
+}
+
+/**
+ * @brief The allocator behind kzalloc and kcalloc, it isn't seen by the profiler
+ * 
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A virtual address pointing to the zeroed region or NULL
+ */
+static void* kheap_zalloc(size_t size)
+{
+    void *ptr = kheap_malloc(size);
+    if(ptr && !kheap_is_large(ptr))
+    {
+        memset(ptr, 0x00, size);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Allocates a zeroed memory region
+ * 
+ * @param size The minimum bytes that need to be reserved
+ * @return void* A virtual address pointing to the zeroed region or NULL
+ * @note Large allocations are not memset: they are fresh demand paged areas
+ * and the page fault handler already hands out zeroed pages
+ */
+void* kzalloc(size_t size)
+{
+    void *ptr = kheap_zalloc(size);
+    kheap_prof_track(ptr, size, (uint64_t)__builtin_return_address(0));
+    return ptr;
+}
+
+/**
+ * @brief Allocates a zeroed array
+ * 
+ * @param count The number of elements
+ * @param size The size of a single element
+ * @return void* A virtual address pointing to the zeroed array or NULL
+ * NULL is also returned if count * size overflows
+ */
+void* kcalloc(size_t count, size_t size)
+{
+    if(size && count > SIZE_MAX / size) return NULL;
+
+    void *ptr = kheap_zalloc(count * size);
+    kheap_prof_track(ptr, count * size, (uint64_t)__builtin_return_address(0));
+    return ptr;
+}
+
+/**
+ * @brief Moves an allocation to a new region
+ * 
+ * @param ptr The old region
+ * @param old_size The usable size of the old region
+ * @param size The size of the new region
+ * @return void* The new region or NULL, in that case ptr is still valid
+ */
+static void* kheap_realloc_copy(void *ptr, size_t old_size, size_t size)
+{
+    void *new_ptr = kheap_malloc(size);
+    if(!new_ptr) return NULL;
+
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    kheap_prof_untrack(ptr);
+    kheap_free(ptr);
+    return new_ptr;
+}
+
+/**
+ * @brief The allocator behind krealloc
+ * The old region is reported to the profiler as freed only once the resize can't fail,
+ * the new one is left for the caller to track
+ * @param ptr A pointer returned by kmalloc, not NULL
+ * @param size The new size, not zero
+ * @return void* The resized region or NULL, in that case ptr is still valid
+ */
+static void* kheap_realloc(void *ptr, size_t size)
+{
+    // Large allocations own whole pages, we can reuse them if they're still enough
+    if(kheap_is_large(ptr))
+    {
+        struct vm_area *area = vmm_get_vm_area(vmm_get_kernel_vas(), (uint64_t)ptr);
+        if(!area) return NULL;
+
+        if(size <= area->size && size >= KHEAP_LARGE_THRESHOLD)
+        {
+            // The pages past the new end are given back lazily, growing again keeps them if they weren't reclaimed
+            uint64_t used = (uint64_t)ptr + size;
+            if(used % PAGING_PAGE_SIZE) used += PAGING_PAGE_SIZE - (used % PAGING_PAGE_SIZE);
+            if(used < area->base + area->size) vmm_advise(vmm_get_kernel_vas(), used, area->base + area->size - used, VMM_ADVICE_FREE);
+
+            kheap_prof_untrack(ptr);
+            return ptr;
+        }
+        return kheap_realloc_copy(ptr, area->size, size);
+    }
+
+    struct kheap_node *node = (struct kheap_node *)ptr - 1;
+
+    // It's becoming large, it has to move to the vmm
+    if(size >= KHEAP_LARGE_THRESHOLD && vmm_get_kernel_vas())
+    {
+        return kheap_realloc_copy(ptr, node->size, size);
+    }
+
+    // Align the size to 16 bytes
+    if(size % KHEAP_BLOCK_SIZE) size += KHEAP_BLOCK_SIZE - (size % KHEAP_BLOCK_SIZE);
+
+    // Shrink in place
+    if(size <= node->size)
+    {
+        kheap_prof_untrack(ptr);
+        kheap_split(node, size);
+
+        // The remainder may touch another free node
+        struct kheap_node *next = node->next;
+        if(next != NULL && next->isFree && next->next != NULL && next->next->isFree)
+        {
+            next->size += next->next->size + sizeof(struct kheap_node);
+            next->next = next->next->next;
+        }
+        return ptr;
+    }
+
+    // Grow in place, the nodes are contiguous so the next one starts right after us
+    struct kheap_node *next = node->next;
+    if(next != NULL && next->isFree && node->size + sizeof(struct kheap_node) + next->size >= size)
+    {
+        kheap_prof_untrack(ptr);
+        node->size += sizeof(struct kheap_node) + next->size;
+        node->next = next->next;
+        kheap_split(node, size);
+        return ptr;
+    }
+
+    return kheap_realloc_copy(ptr, node->size, size);
+}
+
+/**
+ * @brief Changes the size of an allocation
+ * The region is resized in place when possible:
+ * 1) Shrinking splits the node and frees the remainder
+ * 2) Growing absorbs the next node if it's free and big enough
+ * Otherwise a new region is allocated and the content is copied
+ * @param ptr A pointer returned by kmalloc (NULL behaves like kmalloc)
+ * @param size The new size (zero behaves like kfree)
+ * @return void* The resized region or NULL, in that case ptr is still valid
+ */
+void* krealloc(void *ptr, size_t size)
+{
+    uint64_t caller = (uint64_t)__builtin_return_address(0);
+
+    if(!ptr)
+    {
+        ptr = kheap_malloc(size);
+        kheap_prof_track(ptr, size, caller);
+        return ptr;
+    }
+    if(size == 0)
+    {
+        kfree(ptr);
+        return NULL;
+    }
+
+    // For the profiler it's a free followed by a new allocation, a failed resize leaves ptr accounted as it was
+    void *new_ptr = kheap_realloc(ptr, size);
+    kheap_prof_track(new_ptr, size, caller);
+
+    return new_ptr;
+}
+
 /**
  * @brief Prints all the nodes in the kernel heap
  * It's a debug function, for understanding the current kernel heap structure 
@@ -185,8 +630,9 @@ void kheap_print_nodes()
 /**
  * @brief Tries to coalesce near free blocks
  * useful to combat external fragmentation
+ * @return struct kheap_node* The last node of the heap, NULL if it's empty
  */
-static void kheap_coalesce()
+static struct kheap_node *kheap_coalesce()
 {
     struct kheap_node *current = kheap_head;
     while(current != NULL && current->next != NULL)
@@ -206,17 +652,33 @@ static void kheap_coalesce()
             current = current->next;
         }
     }
+
+    return current;
 }
 
 /**
- * @brief Our kernel heap deallocator function
+ * @brief The deallocator behind kfree, it isn't seen by the profiler
  * 
  * @param ptr A pointer to a valid kernel heap region
  */
-void kfree(void *ptr)
+static void kheap_free(void *ptr)
 {
     if(!ptr) return;
 
+    // Large allocations are a whole vmm area (it's never merged nor split), we unmap it
+    if(kheap_is_large(ptr))
+    {
+        struct vm_area *area = vmm_get_vm_area(vmm_get_kernel_vas(), (uint64_t)ptr);
+        if(!area || area->base != (uint64_t)ptr)
+        {
+            log_line(LOG_WARN, "%s: Attempted to free an invalid large region: 0x%llx", __FUNCTION__, (uint64_t)ptr);
+            return;
+        }
+
+        vmm_free(vmm_get_kernel_vas(), area->base, area->size);
+        return;
+    }
+
     // Get the header
     struct kheap_node *node_to_free = (struct kheap_node *)ptr - 1;
     
@@ -231,5 +693,19 @@ void kfree(void *ptr)
     node_to_free->isFree = true;
 
     // Coalesce the blocks to reduce external fragmentation
-    kheap_coalesce();
+    struct kheap_node *last = kheap_coalesce();
+
+    // Give back the tail if it grew too much, the walk above already found it
+    kheap_trim_tail(last);
+}
+
+/**
+ * @brief Our kernel heap deallocator function
+ * 
+ * @param ptr A pointer to a valid kernel heap region
+ */
+void kfree(void *ptr)
+{
+    kheap_prof_untrack(ptr);
+    kheap_free(ptr);
 }
\ No newline at end of file
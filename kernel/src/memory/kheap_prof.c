@@ -0,0 +1,199 @@
+#include <common/logging.h>
+#include <devices/timer.h>
+#include <memory/kheap_prof.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef KHEAP_PROFILER
+
+// This is a sampling allocation-site profiler for the kernel heap.
+// Each allocation decrements a countdown, when it reaches zero the allocation
+// is sampled and the countdown is re-armed with a random value whose mean is
+// the sampling rate, so periodic allocation patterns can't alias with it.
+// The statistics are kept in an open addressing hash table keyed by the caller
+
+static struct kheap_prof_site prof_sites[KHEAP_PROF_SITES];
+static struct kheap_prof_large prof_large[KHEAP_PROF_LARGE_SLOTS];
+
+static uint32_t prof_rate = KHEAP_PROF_DEFAULT_RATE;
+static uint32_t prof_countdown = KHEAP_PROF_DEFAULT_RATE;
+static uint64_t prof_seed = 0x2545F4914F6CDD1D;
+static uint64_t prof_start_ms;
+static uint64_t prof_dropped; // Samples that didn't fit in the tables
+
+/**
+ * @brief Computes how many allocations to skip before the next sample
+ *
+ * @return uint32_t A pseudo random value in [1, 2 * rate - 1]
+ */
+static uint32_t kheap_prof_next_countdown(void)
+{
+    // xorshift64
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+
+    return 1 + (prof_seed % (2 * prof_rate - 1));
+}
+
+/**
+ * @brief Changes the sampling rate of the profiler
+ *
+ * @param rate On average one allocation every rate is sampled, 0 disables the profiler
+ * @note The collected statistics are kept, estimates use the current rate
+ */
+void kheap_prof_set_rate(uint32_t rate)
+{
+    prof_rate = rate;
+    if(rate) prof_countdown = kheap_prof_next_countdown();
+}
+
+/**
+ * @brief Called by the heap for every allocation
+ *
+ * @param caller The return address of the allocating call
+ * @param size The size accounted to the allocation
+ * @return uint32_t The site index + 1 if the allocation was sampled, 0 otherwise.
+ * It must be passed back to kheap_prof_free when the allocation is freed
+ */
+uint32_t kheap_prof_alloc(uint64_t caller, uint64_t size)
+{
+    if(prof_rate == 0 || --prof_countdown) return 0;
+    prof_countdown = kheap_prof_next_countdown();
+
+    if(!prof_start_ms) prof_start_ms = timer_get_uptime_ms();
+
+    // Fibonacci hashing on the caller, then linear probing
+    uint64_t index = ((caller * 0x9E3779B97F4A7C15ull) >> 32) & (KHEAP_PROF_SITES - 1);
+    for(uint64_t i = 0; i < KHEAP_PROF_SITES; i++)
+    {
+        uint64_t slot = (index + i) & (KHEAP_PROF_SITES - 1);
+        struct kheap_prof_site *site = &prof_sites[slot];
+
+        if(site->caller != caller && site->caller != 0) continue;
+
+        site->caller = caller;
+        site->samples++;
+        site->sampled_bytes += size;
+        site->live_samples++;
+        site->live_bytes += size;
+        return slot + 1;
+    }
+
+    // The table is full
+    prof_dropped++;
+    return 0;
+}
+
+/**
+ * @brief Called by the heap when a sampled allocation is freed
+ *
+ * @param site The value returned by kheap_prof_alloc
+ * @param size The same size passed to kheap_prof_alloc
+ */
+void kheap_prof_free(uint32_t site, uint64_t size)
+{
+    if(!site || site > KHEAP_PROF_SITES) return;
+
+    struct kheap_prof_site *entry = &prof_sites[site - 1];
+    if(!entry->live_samples) return;
+
+    entry->live_samples--;
+    entry->live_bytes -= size;
+}
+
+/**
+ * @brief Remembers the site of a sampled large allocation
+ *
+ * @param ptr The address of the large allocation
+ * @param size The size accounted to the allocation
+ * @param site The value returned by kheap_prof_alloc
+ */
+void kheap_prof_large_set(void *ptr, uint64_t size, uint32_t site)
+{
+    if(!site) return;
+
+    for(size_t i = 0; i < KHEAP_PROF_LARGE_SLOTS; i++)
+    {
+        if(prof_large[i].ptr) continue;
+
+        prof_large[i].ptr = ptr;
+        prof_large[i].size = size;
+        prof_large[i].site = site;
+        return;
+    }
+
+    // We can't track when it gets freed, so we don't count it as live
+    kheap_prof_free(site, size);
+    prof_dropped++;
+}
+
+/**
+ * @brief Accounts the free of a large allocation
+ *
+ * @param ptr The address of the large allocation
+ */
+void kheap_prof_large_take(void *ptr)
+{
+    for(size_t i = 0; i < KHEAP_PROF_LARGE_SLOTS; i++)
+    {
+        if(prof_large[i].ptr != ptr) continue;
+
+        kheap_prof_free(prof_large[i].site, prof_large[i].size);
+        prof_large[i].ptr = NULL;
+        return;
+    }
+}
+
+/**
+ * @brief Prints the allocation sites sorted by live bytes
+ * It's printed as debug log so it only goes to the serial port.
+ * The values are estimates: the sampled counters multiplied by the rate
+ * @note The caller addresses can be resolved with addr2line -e kernel/bin/kernel
+ */
+void kheap_prof_dump(void)
+{
+    static uint16_t order[KHEAP_PROF_SITES];
+    size_t count = 0;
+
+    // Insertion sort of the used slots by live bytes
+    for(size_t i = 0; i < KHEAP_PROF_SITES; i++)
+    {
+        if(!prof_sites[i].caller) continue;
+
+        size_t j = count++;
+        while(j > 0 && prof_sites[order[j - 1]].live_bytes < prof_sites[i].live_bytes)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    uint64_t elapsed_ms = timer_get_uptime_ms() - prof_start_ms;
+    uint64_t total_live = 0;
+
+    log_line(LOG_DEBUG, "%s: Kernel heap profile, 1 sample every ~%u allocations over %llu ms", __FUNCTION__, prof_rate, elapsed_ms);
+    log_line(LOG_DEBUG, "%-18s %14s %12s %12s %14s %10s", "caller", "live bytes", "live allocs", "allocs", "bytes", "allocs/s");
+
+    for(size_t i = 0; i < count; i++)
+    {
+        struct kheap_prof_site *site = &prof_sites[order[i]];
+        uint64_t allocs = site->samples * prof_rate;
+
+        log_line(LOG_DEBUG, "0x%016llx %14llu %12llu %12llu %14llu %10llu",
+            site->caller,
+            site->live_bytes * prof_rate,
+            site->live_samples * prof_rate,
+            allocs,
+            site->sampled_bytes * prof_rate,
+            elapsed_ms ? allocs * 1000 / elapsed_ms : 0);
+
+        total_live += site->live_bytes * prof_rate;
+    }
+
+    log_line(LOG_DEBUG, "%s: %llu sites, ~%llu live bytes, %llu dropped samples", __FUNCTION__, count, total_live, prof_dropped);
+}
+
+#endif // KHEAP_PROFILER
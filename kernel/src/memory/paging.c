@@ -2,6 +2,7 @@
 #include <memory/paging.h>
 #include <memory/pmm.h>
 #include <memory/hhdm.h>
+#include <memory/swap.h>
 #include <libk/stdio.h>
 #include <cpu.h>
 #include <stdint.h>
@@ -11,11 +12,70 @@
 
 extern struct limine_executable_address_request executable_addr_request;
 extern struct limine_hhdm_request hhdm_request;
+extern char _KERNEL_START, _KERNEL_END;
 
 static uint64_t *kernel_pml4_phys;
+static bool giant_pages_supported; // Can we use 1GB pages?
+static bool pcid_enabled; // Are the tlb entries tagged with a pcid?
+static uint64_t flush_threshold = PAGING_FLUSH_THRESHOLD; // Pages past which a batch flushes the whole tlb
 
 // We are going to implement 4 level paging with 4kb pages
 
+/**
+ * @brief Updates the number of populated entries of the table holding an entry
+ * The counter lives in the pmm_page of the table, when it drops to zero the table can be freed
+ * @param entry The virtual address (HHDM) of the entry that became populated or empty
+ * @param delta +1 if the entry became populated, -1 if it was cleared
+ */
+static inline void paging_table_account(uint64_t *entry, int delta)
+{
+    struct pmm_page *page = pmm_phys_to_page((uint64_t)hhdm_virtToPhys(entry));
+    if(page) page->table_entries += delta;
+}
+
+/**
+ * @brief Tells if every entry of a table is zero
+ * 
+ * @param table The virtual address (HHDM) of the table
+ * @return true if the table can be freed
+ */
+static inline bool paging_table_is_empty(uint64_t *table)
+{
+    struct pmm_page *page = pmm_phys_to_page((uint64_t)hhdm_virtToPhys(table));
+    return page && page->table_entries == 0;
+}
+
+/**
+ * @brief Returns the table pointed by a directory entry
+ * 
+ * @param entry The directory entry (pml4, pdpr or pd entry)
+ * @param allocate If true and the entry isn't present we allocate a new zeroed table
+ * @return uint64_t* The virtual address (HHDM) of the table or NULL. If allocate = false then
+ * the table isn't present. If allocate = true then there was a problem allocating it
+ * @note The entry must not be a huge page
+ */
+static uint64_t* paging_next_table(uint64_t *entry, bool allocate)
+{
+    if(!(*entry & PTE_FLAG_PRESENT))
+    {
+        if(!allocate) return NULL;
+
+        // We allocate a new page for our new table, reclaim could free the tables we're walking
+        uint64_t phys_new_table = pmm_alloc_atomic(PAGING_PAGE_SIZE);
+        if(!phys_new_table) return NULL;
+
+        // We have to set it to zero
+        memset(hhdm_physToVirt((void *)phys_new_table), 0x00, PAGING_PAGE_SIZE);
+
+        // We set the directory entry as present, readable and writable by all
+        *entry = phys_new_table | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
+        paging_table_account(entry, 1);
+    }
+
+    // we get the addr and convert it using hhdm
+    return hhdm_physToVirt((void *)(*entry & PAGING_PTE_ADDR_MASK));
+}
+
 /**
  * @brief This function will return the page table entry associated with the virtual address
  * This function is very flexible because it can return an already existing pte OR allocate it
@@ -27,91 +87,371 @@ static uint64_t *kernel_pml4_phys;
  * @return uint64_t* the virtual address (HHDM) of the page table entry or NULL. If allocate = false then
  * the pte isn't present. If allocate = true then there was a problem allocating it
  * @note virt_addr does not have to be aligned to a page boundary
+ * @note If the address is mapped by a bigger page than requested we return that leaf entry,
+ * unless allocate = true, in that case we return NULL since it would have to be splitted
  */
 static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool allocate, bool is_huge)
 {
-    // We align the addresses to a 4096 boundary
-    if(virt_addr % PAGING_PAGE_SIZE)
-        virt_addr -= virt_addr % PAGING_PAGE_SIZE;
+    int leaf_level = is_huge ? PAGING_LEVEL_PD : PAGING_LEVEL_PT;
+    uint64_t *table = pml4_root;
+
+    // Descend from the pml4 to the table that holds the leaf
+    for(int level = PAGING_LEVEL_PML4; level > leaf_level; level--)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt_addr, level)];
+
+        // A bigger page maps this address
+        if((*entry & PTE_FLAG_PRESENT) && (*entry & PTE_FLAG_PS))
+        {
+            return allocate ? NULL : entry;
+        }
 
-    uint64_t pml4Index, pdprIndex, pdIndex, ptIndex;
+        table = paging_next_table(entry, allocate);
+        if(!table) return NULL;
+    }
+
+    return &table[PAGING_LEVEL_INDEX(virt_addr, leaf_level)];
+}
+
+/**
+ * @brief Changes how many pages a batch invalidates one by one before using a full flush
+ * 
+ * @param pages The new threshold, capped to PAGING_BATCH_MAX_PAGES
+ */
+void paging_set_flush_threshold(uint64_t pages)
+{
+    flush_threshold = pages > PAGING_BATCH_MAX_PAGES ? PAGING_BATCH_MAX_PAGES : pages;
+}
 
-    // Extract the indexes of page directories/tables from the virtual address
-    pml4Index = PAGING_GET_PML4INDEX(virt_addr);
-    pdprIndex = PAGING_GET_PDPRINDEX(virt_addr);
-    pdIndex = PAGING_GET_PDINDEX(virt_addr);
-    ptIndex = PAGING_GET_PTINDEX(virt_addr);
+/**
+ * @brief Prepares an empty batch
+ * 
+ * @param batch The batch to initialize
+ */
+void paging_batch_init(struct paging_tlb_batch *batch)
+{
+    batch->count = 0;
+    batch->flush_all = false;
+    batch->global = false;
+    batch->nr_frees = 0;
+}
 
-    // ************************ PML4 -> PDPR ******************************
-    uint64_t *virtual_pdpr;
+/**
+ * @brief Adds a page whose translation changed to the batch
+ * 
+ * @param batch The batch
+ * @param virt_addr Any address inside the page (huge pages need a single entry)
+ * @param global True if the old translation was global, a cr3 reload doesn't flush it
+ */
+void paging_batch_add(struct paging_tlb_batch *batch, uint64_t virt_addr, bool global)
+{
+    batch->global |= global;
+    if(batch->flush_all) return;
 
-    if(!(pml4_root[pml4Index] & PTE_FLAG_PRESENT))
+    if(batch->count >= flush_threshold)
     {
-        if(!allocate) return NULL;
-        
-        // We allocate a new page for our new pdpr
-        uint64_t phys_new_pdpr = pmm_alloc(PAGING_PAGE_SIZE);
-        if(!phys_new_pdpr) return NULL;
+        batch->flush_all = true;
+        return;
+    }
 
-        virtual_pdpr = hhdm_physToVirt((void *)phys_new_pdpr);
+    batch->pages[batch->count++] = virt_addr;
+}
 
-        // We have to set it to zero
-        memset(virtual_pdpr, 0x00, PAGING_PAGE_SIZE);
+/**
+ * @brief Releases a frame reference once the batch is flushed
+ * 
+ * @param batch The batch
+ * @param phys_addr The physical address of the frame
+ * @note If the batch is full it's flushed right away
+ */
+void paging_batch_defer_free(struct paging_tlb_batch *batch, uint64_t phys_addr)
+{
+    if(batch->nr_frees == PAGING_BATCH_MAX_FREES) paging_batch_flush(batch);
 
-        // We set the directory entry as present, readable and writable by all
-        pml4_root[pml4Index] = phys_new_pdpr | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
+    batch->frees[batch->nr_frees++] = phys_addr;
+}
+
+/**
+ * @brief Invalidates the gathered pages and then releases the deferred frames
+ * The batch is empty afterwards and can be reused
+ * @param batch The batch
+ */
+void paging_batch_flush(struct paging_tlb_batch *batch)
+{
+    if(batch->flush_all)
+    {
+        if(batch->global)
+        {
+            // Toggling PGE flushes the global entries too
+            uint64_t cr4 = read_cr4();
+            write_cr4(cr4 & ~CR4_PGE_BIT);
+            write_cr4(cr4);
+        }
+        else
+        {
+            write_cr3(read_cr3());
+        }
+    }
+    else
+    {
+        for(uint64_t i = 0; i < batch->count; i++)
+        {
+            asm volatile("invlpg (%0)" :: "r" (batch->pages[i]) : "memory");
+        }
     }
 
-    // we get the addr and convert it using hhdm
-    virtual_pdpr = hhdm_physToVirt((void *)(pml4_root[pml4Index] & PAGING_PTE_ADDR_MASK));
-    
-    // ************************ PDPR -> PD ********************************
-    uint64_t *virtual_pd;
+    // Now no translation can reach the frames
+    for(uint64_t i = 0; i < batch->nr_frees; i++)
+    {
+        pmm_page_dec_ref(batch->frees[i]);
+    }
 
-    if(!(virtual_pdpr[pdprIndex] & PTE_FLAG_PRESENT))
+    paging_batch_init(batch);
+}
+
+/**
+ * @brief Adds the range of a freed page table to the batch
+ * invlpg drops the paging structure caches of the current pcid only. The higher half
+ * tables are shared by every address space, so freeing them needs a full flush
+ * @param batch The batch
+ * @param virt_addr An address that was translated through the table
+ */
+static void paging_batch_add_table(struct paging_tlb_batch *batch, uint64_t virt_addr)
+{
+    if(PAGING_GET_PML4INDEX(virt_addr) >= PAGING_PML4_KERNEL_INDEX)
     {
-        if(!allocate) return NULL;
+        batch->flush_all = true;
+        batch->global = true;
+        return;
+    }
 
-        // We allocate a new page for our new pd
-        uint64_t phys_new_pd = pmm_alloc(PAGING_PAGE_SIZE);
-        if(!phys_new_pd) return NULL;
+    paging_batch_add(batch, virt_addr, false);
+}
 
-        virtual_pd = hhdm_physToVirt((void *)phys_new_pd);
+/**
+ * @brief Tells if the range walker can map a range with a single entry of this level
+ * 
+ * @param level The level of the entry
+ * @param virt The virtual address the entry starts from
+ * @param phys The physical address the entry starts from
+ * @param span How many bytes of the range fall inside this entry
+ * @param page_size The page size requested by the caller, 0 to choose automatically
+ * @return true if the entry can be a leaf
+ */
+static bool paging_can_be_leaf(int level, uint64_t virt, uint64_t phys, uint64_t span, uint64_t page_size)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
 
-        // We have to set it to zero
-        memset(virtual_pd, 0x00, PAGING_PAGE_SIZE);
+    // The caller asked for a specific page size
+    if(page_size) return page_size == entry_size;
 
-        // We set the directory entry as present, readable and writable by all 
-        virtual_pdpr[pdprIndex] = phys_new_pd | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
+    if(level == PAGING_LEVEL_PT) return true;
+
+    // Huge pages need the whole entry and both addresses aligned
+    if(level == PAGING_LEVEL_PD || (level == PAGING_LEVEL_PDPR && giant_pages_supported))
+    {
+        return span == entry_size && !(virt % entry_size) && !(phys % entry_size);
     }
-    // else we get the addr and convert it using hhdm
-    virtual_pd = hhdm_physToVirt((void *)(virtual_pdpr[pdprIndex] & PAGING_PTE_ADDR_MASK));
-    
-    // If the page is huge we stop here
-    if(is_huge) return &virtual_pd[pdIndex];
 
-    // ************************ PD -> PT ********************************
-    uint64_t *virtual_pt;
-    // If the pd entry doesn't exist we must create it
-    if(!(virtual_pd[pdIndex] & PTE_FLAG_PRESENT))
+    return false;
+}
+
+/**
+ * @brief Maps a range walking each table only once
+ * It fills all the entries of a table in a loop before going to the next one,
+ * intermediate tables are allocated only when the range enters them
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param phys The physical address virt is mapped to, page aligned
+ * @param flags x86_64 page flags
+ * @param page_size The leaf page size, 0 to use the biggest the alignment allows
+ * @param batch Collects the replaced translations
+ * @return true if the range was mapped
+ * @return false if a table couldn't be allocated or a huge page is in the way
+ */
+static bool paging_map_range(uint64_t *table, int level, uint64_t virt, uint64_t end, uint64_t phys, uint64_t flags, uint64_t page_size, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
     {
-        if(!allocate) return NULL;
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt, level)];
 
-        // We allocate a new page for our new pt
-        uint64_t phys_new_pt = pmm_alloc(PAGING_PAGE_SIZE);
-        if(!phys_new_pt) return NULL;
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
 
-        virtual_pt = hhdm_physToVirt((void *)phys_new_pt);
+        bool present = *entry & PTE_FLAG_PRESENT;
+        bool leaf = level == PAGING_LEVEL_PT || (*entry & PTE_FLAG_PS);
 
-        // We have to set it to zero
-        memset(virtual_pt, 0x00, PAGING_PAGE_SIZE);
+        // We don't replace a table with a leaf, it would leak the table
+        if((!present || leaf) && paging_can_be_leaf(level, virt, phys, next - virt, page_size))
+        {
+            uint64_t old = *entry;
+            *entry = phys | flags | PTE_FLAG_PRESENT | (level != PAGING_LEVEL_PT ? PTE_FLAG_PS : 0);
+            if(!old) paging_table_account(entry, 1);
+
+            // Only a previous translation can be cached in the tlb
+            if(present) paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+        }
+        else
+        {
+            if(present && leaf)
+            {
+                log_line(LOG_ERROR, "%s: 0x%llx is already mapped by a huge page", __FUNCTION__, virt);
+                return false;
+            }
+
+            uint64_t *next_table = paging_next_table(entry, true);
+            if(!next_table) return false;
+
+            if(!paging_map_range(next_table, level - 1, virt, next, phys, flags, page_size, batch)) return false;
+        }
+
+        phys += next - virt;
+        virt = next;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Replaces a huge page with a table of smaller pages that map the same memory
+ * Every new entry inherits the attributes of the huge page
+ * @param entry The virtual address (HHDM) of the huge page entry
+ * @param level The level of the entry (PD or PDPR)
+ * @param virt An address inside the huge page
+ * @param batch Collects the invalidation of the huge page
+ * @return true if the page was split, false if the table couldn't be allocated
+ */
+static bool paging_split_leaf(uint64_t *entry, int level, uint64_t virt, struct paging_tlb_batch *batch)
+{
+    uint64_t child_size = PAGING_LEVEL_SIZE(level - 1);
+    uint64_t phys = *entry & PAGING_PTE_ADDR_MASK & ~(PAGING_LEVEL_SIZE(level) - 1);
+    uint64_t flags = *entry & ~PAGING_PTE_ADDR_MASK;
+
+    // In a page table entry bit 7 is the PAT bit
+    if(level - 1 == PAGING_LEVEL_PT) flags &= ~PTE_FLAG_PS;
+
+    uint64_t table_phys = pmm_alloc_atomic(PAGING_PAGE_SIZE);
+    if(!table_phys) return false;
 
-        // We set the directory entry as present, readable and writable by all 
-        virtual_pd[pdIndex] = phys_new_pt | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
+    uint64_t *table = hhdm_physToVirt((void *)table_phys);
+    for(size_t i = 0; i < 512; i++)
+    {
+        table[i] = (phys + i * child_size) | flags;
     }
+    pmm_phys_to_page(table_phys)->table_entries = 512;
+
+    // The table must be complete before the walker can see it
+    asm volatile("" ::: "memory");
+
+    uint64_t old = *entry;
+    *entry = table_phys | PTE_FLAG_US | PTE_FLAG_PRESENT | PTE_FLAG_RW;
+    paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+
+    return true;
+}
+
+/**
+ * @brief Splits a huge page that a range covers only in part
+ * 
+ * @param entry The virtual address (HHDM) of the huge page entry
+ * @param level The level of the entry (PD or PDPR)
+ * @param virt An address inside the huge page
+ * @param owned If true the block is split too, so its pieces can be released on their own
+ * @param batch Collects the invalidation of the huge page
+ * @return true if the page was split, false if we're out of memory
+ */
+static bool paging_split_partial_leaf(uint64_t *entry, int level, uint64_t virt, bool owned, struct paging_tlb_batch *batch)
+{
+    uint64_t phys = *entry & PAGING_PTE_ADDR_MASK & ~(PAGING_LEVEL_SIZE(level) - 1);
+
+    if(!paging_split_leaf(entry, level, virt, batch)) return false;
+
+    if(owned) pmm_split_page(phys, PAGING_LEVEL_SHIFT(level - 1) - PAGING_LEVEL_SHIFT(PAGING_LEVEL_PT));
+
+    return true;
+}
+
+/**
+ * @brief Unmaps a range walking each table only once
+ * Non present entries are skipped together with everything below them.
+ * Tables left without populated entries are freed after the flush, except
+ * the higher half pdprs that every address space shares
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param freePhysical If true we decrement the references to the unmapped frames
+ * @param batch Collects the invalidations and the frames to release after them
+ * @note Huge pages partially covered by the range are split and only the covered part goes away,
+ * a block shared with other mappings must be split by the caller first
+ */
+static void paging_unmap_range(uint64_t *table, int level, uint64_t virt, uint64_t end, bool freePhysical, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt, level)];
+
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
+
+        if(!(*entry & PTE_FLAG_PRESENT))
+        {
+            // A swapped out page only holds its slot
+            if(level == PAGING_LEVEL_PT && PTE_IS_SWAP(*entry))
+            {
+                if(freePhysical) swap_free(PTE_SWAP_SLOT(*entry));
 
-    virtual_pt = hhdm_physToVirt((void *)(virtual_pd[pdIndex] & PAGING_PTE_ADDR_MASK));
-    return &virtual_pt[ptIndex];
+                *entry = 0;
+                paging_table_account(entry, -1);
+            }
+        }
+        else if((level == PAGING_LEVEL_PT || (*entry & PTE_FLAG_PS)) && next - virt == entry_size)
+        {
+            uint64_t old = *entry;
+            *entry = 0; // We zero the pte
+            paging_table_account(entry, -1);
+
+            // The tlb entry is invalidated when the batch is flushed
+            paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+
+            // Decrement the number of references to the physical page, after the flush
+            if(freePhysical)
+            {
+                paging_batch_defer_free(batch, old & PAGING_PTE_ADDR_MASK);
+            }
+        }
+        else if((*entry & PTE_FLAG_PS) && !paging_split_partial_leaf(entry, level, virt, freePhysical, batch))
+        {
+            log_line(LOG_ERROR, "%s: Out of memory splitting the huge page at 0x%llx, it stays mapped", __FUNCTION__, virt);
+        }
+        else
+        {
+            uint64_t *next_table = paging_next_table(entry, false);
+            paging_unmap_range(next_table, level - 1, virt, next, freePhysical, batch);
+
+            bool shared = level == PAGING_LEVEL_PML4 && PAGING_GET_PML4INDEX(virt) >= PAGING_PML4_KERNEL_INDEX;
+            if(!shared && paging_table_is_empty(next_table))
+            {
+                uint64_t table_phys = *entry & PAGING_PTE_ADDR_MASK;
+                *entry = 0;
+                paging_table_account(entry, -1);
+
+                // The table could still be cached, it's freed after the flush
+                paging_batch_add_table(batch, virt);
+                paging_batch_defer_free(batch, table_phys);
+            }
+        }
+
+        virt = next;
+    }
 }
 
 /**
@@ -126,12 +466,11 @@ static uint64_t* vmm_get_pte(uint64_t *pml4_root, uint64_t virt_addr, bool alloc
  */
 void paging_map_page(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, bool isHugePage)
 {
-    // We align the addresses to a 2MB boundary
-    if(isHugePage && phys_addr % PAGING_HUGE_PAGE_SIZE)
-        phys_addr -= phys_addr % PAGING_HUGE_PAGE_SIZE;
-    // We align the addresses to a 4KB boundary
-    else if(phys_addr % PAGING_PAGE_SIZE)
-        phys_addr -= phys_addr % PAGING_PAGE_SIZE;
+    uint64_t page_size = isHugePage ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE;
+
+    // We align the addresses to the page boundary
+    virt_addr -= virt_addr % page_size;
+    phys_addr -= phys_addr % page_size;
     
     // The root MUST point to a valid address and we won't map to page zero
     if(!pml4_root || !virt_addr)
@@ -140,19 +479,17 @@ void paging_map_page(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr
         hcf();
     }
 
-    // Allocate the page tables
-    uint64_t *pte = vmm_get_pte(pml4_root, virt_addr, true, isHugePage);
-    if(!pte)
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    // Allocate the page tables and set the new page table entry
+    if(!paging_map_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, virt_addr + page_size, phys_addr, flags, page_size, &batch))
     {
         log_line(LOG_ERROR, "%s: Cannot map new page %llx: OOP", __FUNCTION__, virt_addr);
         hcf();
     }
 
-    // Set the new page table entry
-    *pte = phys_addr | flags | PTE_FLAG_PRESENT | (isHugePage ? PTE_FLAG_PS : 0);
-
-    // Invalidate the corresponding tlb entry
-    asm volatile("invlpg (%0)" :: "r" (virt_addr) : "memory");
+    paging_batch_flush(&batch);
 }
 
 /**
@@ -172,20 +509,14 @@ void paging_unmap_page(uint64_t *pml4_root, uint64_t virt_addr, bool isHugePage,
         hcf();
     }
 
-    uint64_t *pte = vmm_get_pte(pml4_root, virt_addr, false, isHugePage);
-    if(!pte) return; // It's already unmapped
-
-    uint64_t physAddr = *pte & PAGING_PTE_ADDR_MASK;
-    *pte = 0; // We zero the pte
+    uint64_t page_size = isHugePage ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE;
+    virt_addr -= virt_addr % page_size;
 
-    // Invalidate the tlb entry
-    asm volatile("invlpg (%0)" :: "r" (virt_addr) : "memory");
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
 
-    // Decrement the number of references to the physical page
-    if(freePhysical)
-    {
-        pmm_page_dec_ref(physAddr);
-    }       
+    paging_unmap_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, virt_addr + page_size, freePhysical, &batch);
+    paging_batch_flush(&batch);
 }
 
 /**
@@ -207,59 +538,781 @@ void paging_change_page_flags(uint64_t *pml4_root, uint64_t virt_addr, uint64_t
     }
 
     uint64_t *pte = vmm_get_pte(pml4_root, virt_addr, false, isHugePage);
-    if(!pte) return; // If it's not present we return
+    if(!pte || !(*pte & PTE_FLAG_PRESENT)) return; // If it's not present we return
 
-    // substitute the flags
-    *pte = (*pte & PAGING_PTE_ADDR_MASK) | PTE_FLAG_PRESENT | flags;
+    // substitute the flags, a leaf above the page table keeps being a huge page
+    *pte = (*pte & PAGING_PTE_ADDR_MASK) | PTE_FLAG_PRESENT | flags | (*pte & PTE_FLAG_PS);
 
     // Invalidate the tlb entry
     asm volatile("invlpg (%0)" :: "r" (virt_addr) : "memory");
 }
 
 /**
- * @brief This function maps a physically contiguos region into a virtually contiguos one
+ * @brief Replaces a table with a huge page if its entries are uniform
+ * That is they're all present leaves, physically contiguous, with the same attributes
+ * and the first one is aligned to the size of the huge page
+ * @param entry The virtual address (HHDM) of the directory entry pointing to the table
+ * @param level The level of the entry (PD or PDPR)
+ * @param base The first address translated through the entry
+ * @param batch Collects the invalidations and the table to free
+ * @note Only for mappings that don't own their frames, the huge page would hold a single reference
+ */
+static void paging_try_merge(uint64_t *entry, int level, uint64_t base, struct paging_tlb_batch *batch)
+{
+    if(level > PAGING_LEVEL_PDPR || (level == PAGING_LEVEL_PDPR && !giant_pages_supported)) return;
+
+    uint64_t *table = paging_next_table(entry, false);
+    uint64_t child_size = PAGING_LEVEL_SIZE(level - 1);
+    uint64_t first = table[0];
+
+    if(!(first & PTE_FLAG_PRESENT)) return;
+
+    // The children must be leaves, and bit 7 of a page table entry (PAT) has no room in a huge page
+    if(level - 1 == PAGING_LEVEL_PT && (first & PTE_FLAG_PAT)) return;
+    if(level - 1 != PAGING_LEVEL_PT && !(first & PTE_FLAG_PS)) return;
+
+    uint64_t phys = first & PAGING_PTE_ADDR_MASK;
+    uint64_t flags = first & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK;
+    if(phys % PAGING_LEVEL_SIZE(level)) return;
+
+    for(size_t i = 1; i < 512; i++)
+    {
+        if((table[i] & PAGING_PTE_ADDR_MASK) != phys + i * child_size) return;
+        if((table[i] & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK) != flags) return;
+    }
+
+    uint64_t table_phys = *entry & PAGING_PTE_ADDR_MASK;
+    *entry = phys | flags | PTE_FLAG_PS;
+
+    // The small translations and the cached table go away with the flush
+    paging_batch_add_table(batch, base);
+    paging_batch_defer_free(batch, table_phys);
+}
+
+/**
+ * @brief Changes the attributes of the leaves of a range walking each table only once
+ * Huge pages partially covered by the range are split, the tables we went through
+ * are merged back into huge pages if their entries are uniform again
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param set The attributes to set
+ * @param clear The attributes to clear
+ * @param batch Collects the changed translations
+ * @return true if the attributes were changed, false if a split failed
+ * @note Non present pages are skipped
+ */
+static bool paging_attrs_range(uint64_t *table, int level, uint64_t virt, uint64_t end, uint64_t set, uint64_t clear, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt, level)];
+
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
+
+        bool leaf = level == PAGING_LEVEL_PT || (*entry & PTE_FLAG_PS);
+
+        if(!(*entry & PTE_FLAG_PRESENT))
+        {
+            // Nothing is mapped here
+        }
+        else if(leaf && next - virt == entry_size)
+        {
+            uint64_t old = *entry;
+            *entry = (old & ~clear) | set;
+            if(*entry != old) paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+        }
+        else
+        {
+            // Only part of the huge page changes
+            if(leaf && !paging_split_leaf(entry, level, virt, batch)) return false;
+
+            if(!paging_attrs_range(paging_next_table(entry, false), level - 1, virt, next, set, clear, batch)) return false;
+
+            paging_try_merge(entry, level, virt & ~(entry_size - 1), batch);
+        }
+
+        virt = next;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Changes the attributes of a range of the direct map or of the kernel image
  * 
+ * @param vaddr The first virtual address, page aligned
+ * @param npages The number of 4KB pages
+ * @param set The attributes to set
+ * @param clear The attributes to clear
+ * @return true if the attributes were changed
+ * @return false if the range isn't inside the direct map or the kernel image, or a split failed
+ * @note Those mappings don't own their frames, so they can be split and merged freely
+ */
+static bool paging_set_memory(uint64_t vaddr, uint64_t npages, uint64_t set, uint64_t clear)
+{
+    uint64_t end = vaddr + npages * PAGING_PAGE_SIZE;
+    uint64_t hhdm_start = hhdm_request.response->offset;
+    uint64_t hhdm_end = hhdm_start + pmm_getHighestAddr();
+
+    bool in_hhdm = vaddr >= hhdm_start && end <= hhdm_end;
+    bool in_kernel = vaddr >= (uint64_t)&_KERNEL_START && end <= (uint64_t)&_KERNEL_END;
+
+    if(vaddr % PAGING_PAGE_SIZE || end <= vaddr || (!in_hhdm && !in_kernel))
+    {
+        log_line(LOG_ERROR, "%s: Invalid range 0x%llx - 0x%llx", __FUNCTION__, vaddr, end);
+        return false;
+    }
+
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    bool ok = paging_attrs_range(hhdm_physToVirt(kernel_pml4_phys), PAGING_LEVEL_PML4, vaddr, end, set, clear, &batch);
+    paging_batch_flush(&batch);
+
+    if(!ok) log_line(LOG_ERROR, "%s: Cannot split the huge pages of 0x%llx - 0x%llx: OOP", __FUNCTION__, vaddr, end);
+    return ok;
+}
+
+/**
+ * @name Attributes of kernel memory
+ * Change the attributes of npages 4KB pages starting at vaddr, which must be inside
+ * the direct map or the kernel image. Huge pages are split only where needed
+ * and merged back once their pages agree again
+ * @{
+ */
+bool set_memory_ro(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, 0, PTE_FLAG_RW); }
+bool set_memory_rw(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, PTE_FLAG_RW, 0); }
+bool set_memory_nx(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, PTE_FLAG_NO_EXEC, 0); }
+bool set_memory_x(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, 0, PTE_FLAG_NO_EXEC); }
+bool set_memory_wc(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, PTE_CACHE_WC, PTE_FLAG_PWT | PTE_FLAG_PCD); }
+bool set_memory_uc(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, PTE_CACHE_UC, PTE_FLAG_PWT | PTE_FLAG_PCD); }
+bool set_memory_wb(uint64_t vaddr, uint64_t npages) { return paging_set_memory(vaddr, npages, PTE_CACHE_WB, PTE_FLAG_PWT | PTE_FLAG_PCD); }
+/** @} */
+
+/**
+ * @brief Returns the entry where the translation of an address ends
+ * That's the leaf if the address is mapped, otherwise the first non present entry
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address to translate
+ * @param level Filled with the level of the returned entry (can be NULL)
+ * @return uint64_t* The virtual address (HHDM) of the entry, never NULL
+ * @note A present entry above the page table level is a huge page
+ */
+uint64_t *paging_get_entry(uint64_t *pml4_root, uint64_t virt_addr, int *level)
+{
+    uint64_t *table = pml4_root;
+
+    for(int current = PAGING_LEVEL_PML4; ; current--)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt_addr, current)];
+
+        if(current == PAGING_LEVEL_PT || !(*entry & PTE_FLAG_PRESENT) || (*entry & PTE_FLAG_PS))
+        {
+            if(level) *level = current;
+            return entry;
+        }
+
+        table = hhdm_physToVirt((void *)(*entry & PAGING_PTE_ADDR_MASK));
+    }
+}
+
+/**
+ * @brief Prints the current run of a dump and empties it
+ * 
+ * @param state The dump state
+ */
+static void paging_dump_flush_run(struct paging_dump_state *state)
+{
+    if(!state->run_page_size) return;
+
+    static const char *cache_types[] = {"WB", "WC", "UC", "UC"};
+    uint64_t flags = state->run_flags;
+    uint64_t size = state->run_end - state->run_start;
+
+    log_line(LOG_DEBUG, "0x%016llx-0x%016llx %8lluK %s x%-8llu r%c%c %c %c %s",
+        state->run_start,
+        state->run_end,
+        size / 1024,
+        state->run_page_size == PAGING_GIANT_PAGE_SIZE ? "1G" : state->run_page_size == PAGING_HUGE_PAGE_SIZE ? "2M" : "4K",
+        size / state->run_page_size,
+        (flags & PTE_FLAG_RW) ? 'w' : '-',
+        (flags & PTE_FLAG_NO_EXEC) ? '-' : 'x',
+        (flags & PTE_FLAG_US) ? 'u' : 'k',
+        (flags & PTE_FLAG_GLOBAL) ? 'g' : '-',
+        cache_types[((flags & PTE_FLAG_PCD) ? 2 : 0) | ((flags & PTE_FLAG_PWT) ? 1 : 0)]);
+
+    state->run_page_size = 0;
+}
+
+/**
+ * @brief Walks a table for a dump, coalescing the leaves into runs
+ * 
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param base The first address translated through the table
+ * @param state The dump state
+ */
+static void paging_dump_table(uint64_t *table, int level, uint64_t base, struct paging_dump_state *state)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+    state->tables[level]++;
+
+    for(size_t i = 0; i < 512; i++)
+    {
+        uint64_t virt = base + i * entry_size;
+
+        // Addresses of the higher half are sign extended
+        if(level == PAGING_LEVEL_PML4 && i >= PAGING_PML4_KERNEL_INDEX) virt |= 0xFFFF000000000000;
+
+        if(virt + entry_size - 1 < state->start || virt > state->end) continue;
+        if(!(table[i] & PTE_FLAG_PRESENT)) continue;
+
+        if(level != PAGING_LEVEL_PT && !(table[i] & PTE_FLAG_PS))
+        {
+            paging_dump_table(paging_next_table(&table[i], false), level - 1, virt, state);
+            continue;
+        }
+
+        uint64_t flags = table[i] & (PTE_FLAG_RW | PTE_FLAG_US | PTE_FLAG_PWT | PTE_FLAG_PCD | PTE_FLAG_GLOBAL | PTE_FLAG_NO_EXEC);
+        state->leaves[level]++;
+
+        // Extend the run if the leaf continues it
+        if(state->run_page_size == entry_size && state->run_flags == flags && state->run_end == virt)
+        {
+            state->run_end += entry_size;
+            continue;
+        }
+
+        paging_dump_flush_run(state);
+        state->run_start = virt;
+        state->run_end = virt + entry_size;
+        state->run_page_size = entry_size;
+        state->run_flags = flags;
+    }
+}
+
+/**
+ * @brief Prints how a range of an address space is mapped, on the serial port
+ * Every run of contiguous pages with the same size and attributes takes a line,
+ * then the table pages used per level and the tlb entries needed to cover the range
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param start The first virtual address to dump
+ * @param end The last virtual address to dump (included, so the whole address space fits)
+ * @note The tlb estimate assumes one entry per leaf, which is the best case
+ */
+void paging_dump(uint64_t *pml4_root, uint64_t start, uint64_t end)
+{
+    struct paging_dump_state state;
+    memset(&state, 0x00, sizeof(state));
+    state.start = start;
+    state.end = end;
+
+    log_line(LOG_DEBUG, "%s: Page tables of root 0x%llx, range 0x%llx - 0x%llx", __FUNCTION__, hhdm_virtToPhys(pml4_root), start, end);
+    paging_dump_table(pml4_root, PAGING_LEVEL_PML4, 0, &state);
+    paging_dump_flush_run(&state);
+
+    uint64_t table_pages = state.tables[PAGING_LEVEL_PML4] + state.tables[PAGING_LEVEL_PDPR] + state.tables[PAGING_LEVEL_PD] + state.tables[PAGING_LEVEL_PT];
+    uint64_t mapped = state.leaves[PAGING_LEVEL_PT] * PAGING_PAGE_SIZE + state.leaves[PAGING_LEVEL_PD] * PAGING_HUGE_PAGE_SIZE + state.leaves[PAGING_LEVEL_PDPR] * PAGING_GIANT_PAGE_SIZE;
+
+    log_line(LOG_DEBUG, "%s: Table pages: pml4 %llu, pdpr %llu, pd %llu, pt %llu (%llu KB)", __FUNCTION__,
+        state.tables[PAGING_LEVEL_PML4], state.tables[PAGING_LEVEL_PDPR], state.tables[PAGING_LEVEL_PD], state.tables[PAGING_LEVEL_PT],
+        table_pages * PAGING_PAGE_SIZE / 1024);
+    log_line(LOG_DEBUG, "%s: Mapped %llu MB, tlb entries needed: 4K %llu, 2M %llu, 1G %llu", __FUNCTION__,
+        mapped / (1024 * 1024), state.leaves[PAGING_LEVEL_PT], state.leaves[PAGING_LEVEL_PD], state.leaves[PAGING_LEVEL_PDPR]);
+}
+
+/**
+ * @brief Copies the leaves of a range into another page table walking each table only once
+ * 
+ * @param src The virtual address (HHDM) of the source table of the given level
+ * @param dst The virtual address (HHDM) of the destination table of the given level
+ * @param level The level of the tables
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param cow If true both copies become read only and the frames gain a reference
+ * @param batch Collects the source entries that lost the write permission
+ * @return true if the range was copied, false if a table couldn't be allocated
+ */
+static bool paging_clone_range(uint64_t *src, uint64_t *dst, int level, uint64_t virt, uint64_t end, bool cow, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
+    {
+        uint64_t *src_entry = &src[PAGING_LEVEL_INDEX(virt, level)];
+        uint64_t *dst_entry = &dst[PAGING_LEVEL_INDEX(virt, level)];
+
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
+
+        if(!(*src_entry & PTE_FLAG_PRESENT))
+        {
+            // Both address spaces reference the swap slot
+            if(level == PAGING_LEVEL_PT && PTE_IS_SWAP(*src_entry))
+            {
+                swap_dup(PTE_SWAP_SLOT(*src_entry));
+
+                if(!*dst_entry) paging_table_account(dst_entry, 1);
+                *dst_entry = *src_entry;
+            }
+        }
+        else if(level == PAGING_LEVEL_PT || (*src_entry & PTE_FLAG_PS))
+        {
+            if(next - virt != entry_size)
+            {
+                log_line(LOG_WARN, "%s: Cannot copy part of the huge page at 0x%llx", __FUNCTION__, virt);
+            }
+            else
+            {
+                if(cow)
+                {
+                    if(*src_entry & PTE_FLAG_RW)
+                    {
+                        uint64_t old = *src_entry;
+                        *src_entry = old & ~PTE_FLAG_RW;
+                        paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+                    }
+
+                    // A huge page is a single block, the reference count is on its first frame
+                    pmm_page_inc_ref(*src_entry & PAGING_PTE_ADDR_MASK & ~(entry_size - 1));
+                }
+
+                if(!*dst_entry) paging_table_account(dst_entry, 1);
+                *dst_entry = *src_entry;
+            }
+        }
+        else
+        {
+            uint64_t *dst_table = paging_next_table(dst_entry, true);
+            if(!dst_table) return false;
+
+            if(!paging_clone_range(paging_next_table(src_entry, false), dst_table, level - 1, virt, next, cow, batch)) return false;
+        }
+
+        virt = next;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copies the mappings of a range into another address space
+ * With cow the frames become shared read only, the first write to them
+ * faults and the page fault handler gives the writer its own copy
+ * @param src_root The virtual address of the source pml4 root
+ * @param dst_root The virtual address of the destination pml4 root
+ * @param virt_addr The first virtual address of the range, page aligned
+ * @param size The size of the range, page aligned
+ * @param cow If false the entries are copied as they are (eg. MMIO, where frames aren't counted)
+ * @return true if the range was copied, false if a table couldn't be allocated
+ * @note The flush only reaches the current pcid, if the source isn't the current
+ * address space the caller must drop its pcid
+ */
+bool paging_clone_region(uint64_t *src_root, uint64_t *dst_root, uint64_t virt_addr, uint64_t size, bool cow)
+{
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    bool ok = paging_clone_range(src_root, dst_root, PAGING_LEVEL_PML4, virt_addr, virt_addr + size, cow, &batch);
+    paging_batch_flush(&batch);
+
+    return ok;
+}
+
+/**
+ * @brief Harvests the accessed and dirty bits of a range walking each table only once
+ * The accessed bit resets the age of the page, otherwise the age grows by one.
+ * The dirty bit is moved into the soft dirty bit so it isn't lost
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param stats Accumulates what the scan found
+ * @param batch Collects the entries whose bits were cleared, the cpu sets them again only after a tlb miss
+ */
+static void paging_scan_range(uint64_t *table, int level, uint64_t virt, uint64_t end, struct paging_access_stats *stats, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt, level)];
+
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
+
+        if(!(*entry & PTE_FLAG_PRESENT))
+        {
+            // Nothing is mapped here
+        }
+        else if(level == PAGING_LEVEL_PT || (*entry & PTE_FLAG_PS))
+        {
+            uint64_t old = *entry;
+            uint64_t pages = entry_size / PAGING_PAGE_SIZE;
+            uint64_t age = PTE_GET_AGE(old);
+
+            // Page reclaim may have harvested the accessed bit before us
+            if(old & (PTE_FLAG_ACCESSED | PTE_FLAG_SOFT_ACCESSED))
+                age = 0;
+            else if(age < PTE_AGE_MAX)
+                age++;
+
+            uint64_t new = (old & ~(PTE_FLAG_ACCESSED | PTE_FLAG_SOFT_ACCESSED | PTE_FLAG_DIRTY | PTE_AGE_MASK)) | (age << PTE_AGE_SHIFT);
+            if(old & PTE_FLAG_DIRTY)
+            {
+                new |= PTE_FLAG_SOFT_DIRTY;
+                stats->dirty += pages;
+            }
+
+            *entry = new;
+            if(old & (PTE_FLAG_ACCESSED | PTE_FLAG_DIRTY)) paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+
+            stats->resident += pages;
+            stats->age_histogram[age] += pages;
+            if(age == 0) stats->accessed += pages;
+        }
+        else
+        {
+            paging_scan_range(paging_next_table(entry, false), level - 1, virt, next, stats, batch);
+        }
+
+        virt = next;
+    }
+}
+
+/**
+ * @brief Harvests and clears the accessed and dirty bits of a range
+ * 
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The first virtual address of the range, page aligned
+ * @param size The size of the range, page aligned
+ * @param stats Accumulates what the scan found, it's not zeroed
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+void paging_scan_accessed(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, struct paging_access_stats *stats)
+{
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    paging_scan_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, virt_addr + size, stats, &batch);
+    paging_batch_flush(&batch);
+}
+
+/**
+ * @brief Tells if a page was accessed since the last call, and clears its accessed bit
+ * The bit is moved to PTE_FLAG_SOFT_ACCESSED so the working set scan still sees the access
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address of the page
+ * @return true if the accessed bit was set
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+bool paging_test_and_clear_young(uint64_t *pml4_root, uint64_t virt_addr)
+{
+    uint64_t *entry = paging_get_entry(pml4_root, virt_addr, NULL);
+    uint64_t old = *entry;
+
+    if(!(old & PTE_FLAG_PRESENT) || !(old & PTE_FLAG_ACCESSED)) return false;
+
+    *entry = (old & ~PTE_FLAG_ACCESSED) | PTE_FLAG_SOFT_ACCESSED;
+
+    // Otherwise the cpu keeps using the cached translation and never sets the bit again
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+    paging_batch_add(&batch, virt_addr, old & PTE_FLAG_GLOBAL);
+    paging_batch_flush(&batch);
+
+    return true;
+}
+
+/**
+ * @brief Replaces the translation of a 4KB page with a swap entry
+ * The entry stays populated, so the page table isn't freed
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address of the page
+ * @param swap_entry The non present entry, see PTE_MAKE_SWAP
+ * @return uint64_t The replaced entry, 0 if the address isn't mapped by a 4KB page
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+uint64_t paging_set_swap_entry(uint64_t *pml4_root, uint64_t virt_addr, uint64_t swap_entry)
+{
+    int level;
+    uint64_t *entry = paging_get_entry(pml4_root, virt_addr, &level);
+    uint64_t old = *entry;
+
+    if(level != PAGING_LEVEL_PT || !(old & PTE_FLAG_PRESENT)) return 0;
+
+    *entry = swap_entry;
+
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+    paging_batch_add(&batch, virt_addr, old & PTE_FLAG_GLOBAL);
+    paging_batch_flush(&batch);
+
+    return old;
+}
+
+/**
+ * @brief Marks a 4KB page as lazily freed
+ * Its dirty bits are cleared, so a write after this call tells reclaim the content is needed again
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The virtual address of the page
+ * @return true if the page was marked, false if the address isn't mapped by a 4KB page
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+bool paging_mark_lazy_free(uint64_t *pml4_root, uint64_t virt_addr)
+{
+    int level;
+    uint64_t *entry = paging_get_entry(pml4_root, virt_addr, &level);
+    uint64_t old = *entry;
+
+    if(level != PAGING_LEVEL_PT || !(old & PTE_FLAG_PRESENT)) return false;
+
+    *entry = (old & ~(PTE_FLAG_DIRTY | PTE_FLAG_SOFT_DIRTY)) | PTE_FLAG_LAZY_FREE;
+
+    // A cached translation that says dirty would let the next write go unnoticed
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+    paging_batch_add(&batch, virt_addr, old & PTE_FLAG_GLOBAL);
+    paging_batch_flush(&batch);
+
+    return true;
+}
+
+/**
+ * @brief Replaces the 2MB page that maps an address with a table of 4KB pages
+ * The new pages map the same memory with the same attributes
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr An address inside the huge page
+ * @return true if the page was split, false if the address isn't mapped by a 2MB page or we're out of memory
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+bool paging_split_huge_page(uint64_t *pml4_root, uint64_t virt_addr)
+{
+    int level;
+    uint64_t *entry = paging_get_entry(pml4_root, virt_addr, &level);
+
+    if(level != PAGING_LEVEL_PD || !(*entry & PTE_FLAG_PRESENT)) return false;
+
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    bool split = paging_split_leaf(entry, level, virt_addr, &batch);
+    paging_batch_flush(&batch);
+
+    return split;
+}
+
+/**
+ * @brief This function maps a physically contiguos region into a virtually contiguos one
+ * The page tables are walked once per table and not once per page.
+ * If isHugePage is false the walker still uses 2MB (or 1GB if supported) pages wherever
+ * both addresses are aligned and the region covers the whole page
  * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
  * @param virt_addr The starting virtual address belonging to the first page that we want to map to
  * @param phys_addr The starting physical address belonging to the first frame that we want to map from
  * @param size The size of the region 
  * @param flags The x86_64 flags for each page in the region
- * @param isHugePage If true then the mapped pages are considered huge pages (2MB)
+ * @param isHugePage If true then the mapped pages are only huge pages (2MB)
  * @note virt_addr and phys_addr do not have to be aligned to a page boundary
  */
 void paging_map_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags, bool isHugePage)
 {
-    uint64_t virtual, physical;
-    for(virtual = virt_addr, physical = phys_addr; virtual < virt_addr + size; isHugePage ? 
-        (virtual += PAGING_HUGE_PAGE_SIZE, physical += PAGING_HUGE_PAGE_SIZE) :
-        (virtual += PAGING_PAGE_SIZE, physical += PAGING_PAGE_SIZE))
+    uint64_t page_size = isHugePage ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE;
+
+    // Align the start down and the end up
+    uint64_t end = virt_addr + size;
+    if(end % page_size) end += page_size - (end % page_size);
+    virt_addr -= virt_addr % page_size;
+    phys_addr -= phys_addr % page_size;
+
+    if(!pml4_root || !virt_addr)
     {
-        paging_map_page(pml4_root, virtual, physical, flags, isHugePage);
+        log_line(LOG_ERROR, "%s: Error address invalid", __FUNCTION__);
+        hcf();
     }
+
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    if(!paging_map_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, end, phys_addr, flags, isHugePage ? page_size : 0, &batch))
+    {
+        log_line(LOG_ERROR, "%s: Cannot map region 0x%llx - 0x%llx: OOP", __FUNCTION__, virt_addr, end);
+        hcf();
+    }
+
+    paging_batch_flush(&batch);
+
     log_line(LOG_DEBUG, "%s: Memory region mapped\r\n\tvirtual range: 0x%llx - 0x%llx\r\n\tphysical range: 0x%llx - 0x%llx", 
-        __FUNCTION__, virt_addr, virtual, phys_addr, physical);
+        __FUNCTION__, virt_addr, end, phys_addr, phys_addr + (end - virt_addr));
 }
 
 /**
  * @brief This function unmaps a virtually contiguos region
- * 
+ * The page tables are walked once per table, unmapped subtrees are skipped entirely.
+ * Huge pages are detected by the walker, the ones the region covers only in part are split
  * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
  * @param virt_addr The starting virtual address belonging to the first page that we want to map to
  * @param size The size of the region 
- * @param isHugePage If true then the mapped pages are considered huge pages (2MB)
+ * @param isHugePage If true the region is aligned to huge pages (2MB)
  * @note virt_addr does not have to be aligned to a page boundary
  */
 void paging_unmap_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, bool isHugePage, bool freePhysical)
 {
-    uint64_t virtual;
-    for(virtual = virt_addr; virtual < virt_addr + size; isHugePage ? 
-        (virtual += PAGING_HUGE_PAGE_SIZE) : 
-        (virtual += PAGING_PAGE_SIZE))
+    uint64_t page_size = isHugePage ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE;
+
+    // Align the start down and the end up
+    uint64_t end = virt_addr + size;
+    if(end % page_size) end += page_size - (end % page_size);
+    virt_addr -= virt_addr % page_size;
+
+    if(!pml4_root || !virt_addr)
     {
-        paging_unmap_page(pml4_root, virtual, isHugePage, freePhysical);
+        log_line(LOG_ERROR, "%s: Error address invalid", __FUNCTION__);
+        hcf();
     }
+
+    // The invalidations are gathered and done once at the end,
+    // past the flush threshold a single full flush replaces the invlpg
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    paging_unmap_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, end, freePhysical, &batch);
+    paging_batch_flush(&batch);
+
     log_line(LOG_DEBUG, "%s: Memory region unmapped\r\n\tvirtual range: 0x%llx - 0x%llx\r\n", 
-        __FUNCTION__, virt_addr, virtual);
+        __FUNCTION__, virt_addr, end);
+}
+
+/**
+ * @brief Changes the permissions of the present leaves of a range walking each table only once
+ * Huge pages partially covered by the range are split, unless their permissions don't change
+ * @param table The virtual address (HHDM) of a table of the given level
+ * @param level The level of the table
+ * @param virt The first virtual address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param flags The new x86_64 flags of the leaves, their usage bits are kept
+ * @param cow If true the frames are owned by the mapping and the shared or not counted ones stay read only
+ * @param batch Collects the changed translations
+ */
+static void paging_protect_range(uint64_t *table, int level, uint64_t virt, uint64_t end, uint64_t flags, bool cow, struct paging_tlb_batch *batch)
+{
+    uint64_t entry_size = PAGING_LEVEL_SIZE(level);
+
+    while(virt < end)
+    {
+        uint64_t *entry = &table[PAGING_LEVEL_INDEX(virt, level)];
+
+        // The range covered by this entry (the check on next < virt handles the wrap around)
+        uint64_t next = (virt & ~(entry_size - 1)) + entry_size;
+        if(next > end || next < virt) next = end;
+
+        bool leaf = level == PAGING_LEVEL_PT || (*entry & PTE_FLAG_PS);
+        uint64_t old = *entry;
+        uint64_t updated = old;
+
+        if((old & PTE_FLAG_PRESENT) && leaf)
+        {
+            uint64_t leaf_flags = flags;
+
+            // The first write to a shared page must still fault and copy it
+            struct pmm_page *frame = pmm_phys_to_page(old & PAGING_PTE_ADDR_MASK & ~(entry_size - 1));
+            if(cow && (!frame || frame->ref_count > 1)) leaf_flags &= ~PTE_FLAG_RW;
+
+            // A leaf above the page table keeps being a huge page
+            updated = (old & (PAGING_PTE_ADDR_MASK | PTE_USAGE_MASK)) | leaf_flags | PTE_FLAG_PRESENT;
+            if(level != PAGING_LEVEL_PT) updated |= old & PTE_FLAG_PS;
+        }
+
+        if(!(old & PTE_FLAG_PRESENT) || updated == old)
+        {
+            // Nothing is mapped here or it already has the permissions,
+            // a swapped out page gets the permissions of the area when it comes back
+        }
+        else if(leaf && next - virt == entry_size)
+        {
+            *entry = updated;
+            paging_batch_add(batch, virt, old & PTE_FLAG_GLOBAL);
+        }
+        else if(leaf && !paging_split_partial_leaf(entry, level, virt, cow, batch))
+        {
+            log_line(LOG_ERROR, "%s: Out of memory splitting the huge page at 0x%llx, it keeps its permissions", __FUNCTION__, virt);
+        }
+        else
+        {
+            paging_protect_range(paging_next_table(entry, false), level - 1, virt, next, flags, cow, batch);
+        }
+
+        virt = next;
+    }
+}
+
+/**
+ * @brief Changes the permissions of the pages mapped in a virtually contiguos region
+ * The page tables are walked once per table and the invalidations are done once at the end
+ * @param pml4_root The virtual address of the pml4 root, necessary because there can be many VAS
+ * @param virt_addr The starting virtual address of the region, page aligned
+ * @param size The size of the region
+ * @param flags The updated x86_64 flags, the usage bits of each page are kept
+ * @param cow If true the frames are owned by the mapping, the ones that are shared
+ * or not counted stay read only so the first write still copies them
+ * @note The flush only reaches the current pcid, for other address spaces
+ * the caller must drop their pcid
+ */
+void paging_protect_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size, uint64_t flags, bool cow)
+{
+    if(!pml4_root || !virt_addr)
+    {
+        log_line(LOG_ERROR, "%s: Error address invalid", __FUNCTION__);
+        hcf();
+    }
+
+    struct paging_tlb_batch batch;
+    paging_batch_init(&batch);
+
+    paging_protect_range(pml4_root, PAGING_LEVEL_PML4, virt_addr, virt_addr + size, flags, cow, &batch);
+    paging_batch_flush(&batch);
+}
+
+/**
+ * @brief Checks if the cpu supports 1GB pages
+ * 
+ * @return true if the PDPE1GB feature is present
+ */
+static bool paging_detect_giant_pages(void)
+{
+    uint32_t max_leaf, edx;
+
+    cpu_cpuid(CPUID_EXT_MAX_LEAF, 0, &max_leaf, NULL, NULL, NULL);
+    if(max_leaf < CPUID_EXT_FEATURES_LEAF) return false;
+
+    cpu_cpuid(CPUID_EXT_FEATURES_LEAF, 0, NULL, NULL, NULL, &edx);
+    return (edx & CPUID_EXT_EDX_PDPE1GB) != 0;
+}
+
+/**
+ * @brief Checks if the cpu supports process context identifiers
+ * 
+ * @return true if the PCID feature is present
+ */
+static bool paging_detect_pcid(void)
+{
+    uint32_t ecx;
+
+    cpu_cpuid(CPUID_FEATURES_LEAF, 0, NULL, NULL, &ecx, NULL);
+    return (ecx & CPUID_ECX_PCID) != 0;
 }
 
 /**
@@ -267,9 +1320,10 @@ void paging_unmap_region(uint64_t *pml4_root, uint64_t virt_addr, uint64_t size,
  * 1) It creates a new pml4 table for exclusive use by the kernel. 
  * 2) Maps the following regions: limine_requests, text, rodata and data with the correct permissions
  * at the KERNEL_START addr.
- * 3) It maps all RAM into the hhdm region
+ * 3) It maps all RAM into the hhdm region, with 1GB pages when the cpu supports them
  * 4) It enables global pages
- * 5) Finally switches to the pml4 we created before
+ * 5) Switches to the pml4 we created before
+ * 6) Finally enables PCIDs if the cpu supports them
  */
 void paging_init(void)
 {
@@ -286,6 +1340,9 @@ void paging_init(void)
 
     cpu_wrmsr(MSR_IA32_PAT, pat_val);
 
+    giant_pages_supported = paging_detect_giant_pages();
+    log_line(LOG_DEBUG, "%s: 1GB pages %s", __FUNCTION__, giant_pages_supported ? "supported" : "not supported");
+
     // Allocate the kernel pml4
     kernel_pml4_phys = (uint64_t *) pmm_alloc(PAGING_PAGE_SIZE);
     if(!kernel_pml4_phys)
@@ -308,6 +1365,13 @@ void paging_init(void)
         _DATA_START, _DATA_END;
 
     uint64_t k_phys = executable_addr_request.response->physical_base;
+
+    // The segments are padded to the linker max page size, when it's 2MB (KERNEL_HUGE_PAGES=1)
+    // and the kernel is loaded 2MB aligned the walker maps them with global huge pages
+    if(k_phys % PAGING_HUGE_PAGE_SIZE == 0 && ((uint64_t)&_TEXT_END - (uint64_t)&_TEXT_START) % PAGING_HUGE_PAGE_SIZE == 0)
+    {
+        log_line(LOG_DEBUG, "%s: Kernel segments are mapped with huge pages", __FUNCTION__);
+    }
     
     // Map the limine requests segment (Read + Write)
     paging_map_region(hhdm_physToVirt(kernel_pml4_phys), 
@@ -340,13 +1404,22 @@ void paging_init(void)
     // ************ HHDM mapping ****************
 
     // Mapping all RAM to HHDM offset
+    // The walker uses 1GB pages where aligned and falls back to 2MB and 4KB at the end
     uint64_t phys_highestAddr = pmm_getHighestAddr();
 
     paging_map_region(hhdm_physToVirt(kernel_pml4_phys), 
         hhdm_request.response->offset, 
         0, 
-        phys_highestAddr - 1, 
-        PTE_FLAG_RW | PTE_FLAG_GLOBAL, true);
+        phys_highestAddr, 
+        PTE_FLAG_RW | PTE_FLAG_GLOBAL, false);
+
+    // Copy on write relies on the kernel faulting on read only pages too
+    uint64_t cr0 = read_cr0();
+    if(!(cr0 & CR0_WP_BIT))
+    {
+        write_cr0(cr0 | CR0_WP_BIT);
+        log_line(LOG_DEBUG, "%s: CR0 Write Protect (WP) Enabled", __FUNCTION__);
+    }
 
     // We need to enable global pages
     uint64_t cr4 = read_cr4();
@@ -360,6 +1433,14 @@ void paging_init(void)
 
     paging_switch_context(kernel_pml4_phys);
     log_line(LOG_SUCCESS, "%s: Switched to kernel pml4.", __FUNCTION__);
+
+    // PCIDE can be set only while cr3[11:0] is zero, so after the switch (the kernel uses pcid 0)
+    if(paging_detect_pcid())
+    {
+        write_cr4(read_cr4() | CR4_PCIDE_BIT);
+        pcid_enabled = true;
+        log_line(LOG_DEBUG, "%s: CR4 Process Context Identifiers (PCIDE) Enabled", __FUNCTION__);
+    }
 }
 
 /**
@@ -372,6 +1453,38 @@ inline void paging_switch_context(uint64_t *pml4_phys)
     asm volatile("mov %0, %%cr3" :: "r"(pml4_phys) : "memory");
 }
 
+/**
+ * @brief Switches the page table root tagging its tlb entries with a pcid
+ * Without PCID support it's the same as paging_switch_context
+ * @param pml4_phys The physical address of the pml4 we want to switch to
+ * @param pcid The process context identifier of the address space
+ * @param flush If true the tlb entries tagged with pcid are invalidated,
+ * needed when the pcid was used by another address space before
+ */
+void paging_switch_context_pcid(uint64_t *pml4_phys, uint16_t pcid, bool flush)
+{
+    if(!pcid_enabled)
+    {
+        paging_switch_context(pml4_phys);
+        return;
+    }
+
+    uint64_t cr3 = (uint64_t)pml4_phys | (pcid & (PAGING_PCID_COUNT - 1));
+    if(!flush) cr3 |= PAGING_CR3_NOFLUSH;
+
+    write_cr3(cr3);
+}
+
+/**
+ * @brief Tells if the tlb entries are tagged with a pcid
+ * 
+ * @return true if PCIDs are enabled
+ */
+bool paging_pcid_enabled(void)
+{
+    return pcid_enabled;
+}
+
 /**
  * @brief A getter for the physical address of the kernel pml4
  * 
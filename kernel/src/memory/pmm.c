@@ -26,6 +26,17 @@ static uint64_t used_pages, totalPages;
 // Highest usable RAM Addr
 static uint64_t highestAddr = 0;
 
+// The min, low and high watermarks in pages
+static uint64_t watermarks[3];
+
+// Called when an allocation fails, and a guard against reclaim allocating
+static pmm_reclaim_fn direct_reclaimer = NULL;
+static bool in_reclaim = false;
+
+// The inactive (0) and active (1) LRU lists of the pages mapped by the vmm
+static struct double_ll_node lru_lists[2];
+static uint64_t lru_sizes[2];
+
 /********************** UTILITY FUNCTIONS FOR BUDDY ***********************/
 
 static inline struct pmm_page *pfn_to_page(uint64_t pfn)
@@ -64,6 +75,9 @@ void pmm_free_pages(uint64_t phys, uint32_t order)
     struct pmm_page *page = pfn_to_page(pfn);
     if(!page) return;
 
+    // The link is about to be used by the free lists
+    if(page->flags & PMM_FLAG_LRU) pmm_lru_del(page);
+
     // Coalescing buddys
     while(order < PMM_MAX_ORDER - 1)
     {
@@ -166,10 +180,66 @@ uint64_t pmm_alloc_pages(uint32_t order)
     page->flags = PMM_FLAG_USED;
     page->ref_count = 1;
     page->order = order;
+    page->table_entries = 0;
 
     return page_to_phys(page);
 }
 
+/**
+ * @brief Marks the start of a reclaim pass
+ * Until pmm_reclaim_exit the allocations don't enter direct reclaim, the pages
+ * the pass is working on would be reclaimed twice, and they may use the reserve
+ * below the min watermark
+ * @return true if we entered, false if a reclaim pass is already running
+ */
+bool pmm_reclaim_enter(void)
+{
+    if(in_reclaim) return false;
+
+    in_reclaim = true;
+    return true;
+}
+
+/**
+ * @brief Marks the end of a reclaim pass started with pmm_reclaim_enter
+ */
+void pmm_reclaim_exit(void)
+{
+    in_reclaim = false;
+}
+
+/**
+ * @brief Asks the reclaimer to free memory after an allocation failed
+ * 
+ * @param pages How many pages we're missing
+ * @return uint64_t How many pages were freed
+ */
+static uint64_t pmm_direct_reclaim(uint64_t pages)
+{
+    // The reclaimer itself may need memory, it mustn't reclaim again
+    if(!direct_reclaimer || !pmm_reclaim_enter()) return 0;
+
+    uint64_t freed = direct_reclaimer(pages);
+    pmm_reclaim_exit();
+
+    return freed;
+}
+
+/**
+ * @brief Allocates a block unless it would take us below the min watermark
+ * The pages below it are a reserve for the reclaimer and for page tables,
+ * so reclaim can always make progress
+ * @param order The order of the block
+ * @param reserve If true the allocation may use the reserve
+ * @return uint64_t The physical address of the block, 0 on failure
+ */
+static uint64_t pmm_alloc_above_min(uint32_t order, bool reserve)
+{
+    if(!reserve && !in_reclaim && totalPages - used_pages < watermarks[PMM_WMARK_MIN] + (1ULL << order)) return 0;
+
+    return pmm_alloc_pages(order);
+}
+
 /**
  * @brief Convert a size (bytes) into an order type
  * 
@@ -199,12 +269,91 @@ uint64_t pmm_alloc(uint64_t size)
     uint32_t order = pmm_get_order_from_size(size);
     if(order >= PMM_MAX_ORDER) return 0; // Too big
 
-    uint64_t phys = pmm_alloc_pages(order);
+    uint64_t phys = pmm_alloc_above_min(order, false);
+
+    // Costly orders have fallbacks (like small pages for THP), they just fail
+    if(!phys && order <= PMM_RECLAIM_MAX_ORDER && pmm_direct_reclaim(1ULL << order))
+        phys = pmm_alloc_above_min(order, false);
+
+    if(phys != 0) used_pages += (1ULL << order);
+
+    return phys;
+}
+
+/**
+ * @brief Allocates physical memory without entering reclaim
+ * Used for page tables: the walkers hold pointers into the tables that reclaim could free.
+ * It may use the reserve below the min watermark
+ * @param size The number of bytes of physical memory to allocate
+ * @return uint64_t the physical address of the newly allocated block, 0 on failure
+ */
+uint64_t pmm_alloc_atomic(uint64_t size)
+{
+    uint32_t order = pmm_get_order_from_size(size);
+    if(order >= PMM_MAX_ORDER) return 0; // Too big
+
+    uint64_t phys = pmm_alloc_above_min(order, true);
     if(phys != 0) used_pages += (1ULL << order);
 
     return phys;
 }
 
+/**
+ * @brief Allocates many single pages with as few buddy allocations as possible
+ * A block big enough is split into independent 4KB pages, each one with its own
+ * reference count, the pages we don't need go back to the free lists
+ * @param pages Filled with the physical addresses of the pages
+ * @param count How many pages we want
+ * @return uint64_t How many pages were allocated, less than count only if we're out of memory
+ */
+uint64_t pmm_alloc_bulk(uint64_t *pages, uint64_t count)
+{
+    uint64_t allocated = 0;
+    bool reclaimed = false;
+
+    while(allocated < count)
+    {
+        // The smallest block that holds the remaining pages
+        uint32_t order = 0;
+        while(order < PMM_MAX_ORDER - 1 && (1ULL << order) < count - allocated) order++;
+
+        // Fragmented memory, try smaller blocks
+        uint64_t phys = 0;
+        while(!(phys = pmm_alloc_above_min(order, false)) && order > 0) order--;
+        if(!phys)
+        {
+            // Out of memory, reclaim what's missing once and try again
+            if(reclaimed || !pmm_direct_reclaim(count - allocated)) break;
+            reclaimed = true;
+            continue;
+        }
+
+        uint64_t block_pages = 1ULL << order;
+        used_pages += block_pages;
+
+        for(uint64_t i = 0; i < block_pages; i++)
+        {
+            struct pmm_page *page = phys_to_page(phys + i * PMM_PAGE_SIZE);
+            page->flags = PMM_FLAG_USED;
+            page->ref_count = 1;
+            page->order = 0;
+            page->table_entries = 0;
+
+            if(allocated < count)
+            {
+                pages[allocated++] = phys + i * PMM_PAGE_SIZE;
+            }
+            else
+            {
+                pmm_free_pages(phys + i * PMM_PAGE_SIZE, 0);
+                used_pages--;
+            }
+        }
+    }
+
+    return allocated;
+}
+
 /**
  * @brief Our main function for deallocating physical memory
  * 
@@ -292,6 +441,9 @@ void pmm_init()
         free_areas[i].nr_free = 0;
     }
 
+    dll_init(&lru_lists[0]);
+    dll_init(&lru_lists[1]);
+
     // Fill the memmap as used
     // Note that we memset'd to 0 the entire memmap before so order and link = 0
     used_pages = totalPages;
@@ -351,6 +503,11 @@ void pmm_init()
         }
     }
 
+    // The watermarks scale with the memory we manage
+    watermarks[PMM_WMARK_MIN] = (totalPages - used_pages) / PMM_WMARK_MIN_DIVISOR;
+    watermarks[PMM_WMARK_LOW] = watermarks[PMM_WMARK_MIN] * 2;
+    watermarks[PMM_WMARK_HIGH] = watermarks[PMM_WMARK_MIN] * 3;
+
     log_line(LOG_SUCCESS, "%s: PMM initialized:\r\n\tBuddy allocator structures size %lu bytes\r\n\tBuddy allocator start virt addr 0x%lx\r\n\tManaging %llu pages", __FUNCTION__, buddy_memmap_size, buddy_memmap, totalPages);
 }
 
@@ -365,7 +522,11 @@ void pmm_page_inc_ref(uint64_t phys)
     struct pmm_page *page = phys_to_page(phys);
     
     if(page && (page->flags & PMM_FLAG_USED))
+    {
+        // We don't know every mapping of a shared page, so reclaim can't touch it
+        if(page->flags & PMM_FLAG_LRU) pmm_lru_del(page);
         page->ref_count++;
+    }
 }
 
 /**
@@ -382,12 +543,175 @@ void pmm_page_dec_ref(uint64_t phys)
         page->ref_count--;
         if(page->ref_count == 0)
         {
-            pmm_free_pages(phys, page->order);
-            used_pages--;
+            // The order changes while coalescing
+            uint32_t order = page->order;
+            pmm_free_pages(phys, order);
+            used_pages -= (1ULL << order);
         }
     }
 }
 
+/**
+ * @brief Splits an allocated block into independent smaller blocks
+ * Like the blocks of pmm_alloc_bulk, each piece gets the reference count
+ * of the block and is freed on its own
+ * @param phys The physical address of the block
+ * @param order The order of the pieces, 0 for 4KB pages
+ */
+void pmm_split_page(uint64_t phys, uint32_t order)
+{
+    struct pmm_page *page = phys_to_page(phys);
+    if(!page || !(page->flags & PMM_FLAG_USED) || page->order <= order) return;
+
+    uint64_t block_pages = 1ULL << page->order;
+    uint32_t ref_count = page->ref_count;
+
+    for(uint64_t i = 0; i < block_pages; i++)
+    {
+        struct pmm_page *sub_page = phys_to_page(phys + i * PMM_PAGE_SIZE);
+        sub_page->flags = PMM_FLAG_USED;
+        sub_page->ref_count = ref_count;
+        sub_page->order = (i % (1ULL << order)) ? 0 : order;
+        sub_page->table_entries = 0;
+    }
+}
+
+/**
+ * @brief Returns the descriptor of a physical page
+ * 
+ * @param phys The physical address of the page
+ * @return struct pmm_page* The page struct, NULL if the address is out of the memmap
+ */
+struct pmm_page *pmm_phys_to_page(uint64_t phys)
+{
+    return phys_to_page(phys);
+}
+
+/**
+ * @brief Returns the physical address described by a page struct
+ * 
+ * @param page The page struct
+ * @return uint64_t The physical address of the page
+ */
+uint64_t pmm_page_to_phys(struct pmm_page *page)
+{
+    return page_to_phys(page);
+}
+
+/**
+ * @brief Returns how many pages are free
+ * 
+ * @return uint64_t The number of free pages
+ */
+uint64_t pmm_get_free_pages(void)
+{
+    return totalPages - used_pages;
+}
+
+/**
+ * @brief Returns a watermark
+ * 
+ * @param wmark PMM_WMARK_MIN, PMM_WMARK_LOW or PMM_WMARK_HIGH
+ * @return uint64_t The watermark in pages
+ */
+uint64_t pmm_get_watermark(int wmark)
+{
+    if(wmark < PMM_WMARK_MIN || wmark > PMM_WMARK_HIGH) return 0;
+    return watermarks[wmark];
+}
+
+/**
+ * @brief Sets the function called when an allocation fails
+ * 
+ * @param reclaimer The function, NULL disables direct reclaim
+ */
+void pmm_set_reclaimer(pmm_reclaim_fn reclaimer)
+{
+    direct_reclaimer = reclaimer;
+}
+
+/**
+ * @brief Starts tracking a mapped page on the inactive LRU list
+ * 
+ * @param phys The physical address of the page, it must be a single used page
+ * @param owner The only address space that maps the page
+ * @param vaddr Where the owner maps the page
+ */
+void pmm_lru_add(uint64_t phys, struct vm_address_space *owner, uint64_t vaddr)
+{
+    struct pmm_page *page = phys_to_page(phys);
+    if(!page || !(page->flags & PMM_FLAG_USED) || (page->flags & PMM_FLAG_LRU) || page->order) return;
+
+    page->owner = owner;
+    page->vaddr = vaddr;
+    page->flags |= PMM_FLAG_LRU;
+
+    dll_add_after(&lru_lists[0], &page->link);
+    lru_sizes[0]++;
+}
+
+/**
+ * @brief Stops tracking a page on the LRU lists
+ * 
+ * @param page The page struct
+ */
+void pmm_lru_del(struct pmm_page *page)
+{
+    if(!(page->flags & PMM_FLAG_LRU)) return;
+
+    dll_delete(&page->link);
+    lru_sizes[(page->flags & PMM_FLAG_ACTIVE) != 0]--;
+
+    page->flags &= ~(PMM_FLAG_LRU | PMM_FLAG_ACTIVE);
+    page->owner = NULL;
+}
+
+/**
+ * @brief Moves a page to the head (most recently used end) of an LRU list
+ * 
+ * @param page The page struct, it must be on an LRU list
+ * @param active true for the active list, false for the inactive one
+ */
+void pmm_lru_move(struct pmm_page *page, bool active)
+{
+    if(!(page->flags & PMM_FLAG_LRU)) return;
+
+    dll_delete(&page->link);
+    lru_sizes[(page->flags & PMM_FLAG_ACTIVE) != 0]--;
+
+    if(active)
+        page->flags |= PMM_FLAG_ACTIVE;
+    else
+        page->flags &= ~PMM_FLAG_ACTIVE;
+
+    dll_add_after(&lru_lists[active], &page->link);
+    lru_sizes[active]++;
+}
+
+/**
+ * @brief Returns the least recently used page of an LRU list
+ * 
+ * @param active true for the active list, false for the inactive one
+ * @return struct pmm_page* The page, NULL if the list is empty
+ */
+struct pmm_page *pmm_lru_tail(bool active)
+{
+    if(dll_empty(&lru_lists[active])) return NULL;
+
+    return (struct pmm_page *)((uint8_t *)lru_lists[active].prev - offsetof(struct pmm_page, link));
+}
+
+/**
+ * @brief Returns how many pages an LRU list holds
+ * 
+ * @param active true for the active list, false for the inactive one
+ * @return uint64_t The number of pages
+ */
+uint64_t pmm_lru_size(bool active)
+{
+    return lru_sizes[active];
+}
+
 /**
  * @brief Prints the state of our buddy allocator, nicely formatted 
  */
@@ -410,6 +734,8 @@ void pmm_dump_state(void)
     log_line(LOG_DEBUG, "Total Memory: %llu MB", (totalPages * PMM_PAGE_SIZE) / 1024 / 1024);
     log_line(LOG_DEBUG, "Used Memory:  %llu MB", (used_pages * PMM_PAGE_SIZE) / 1024 / 1024);
     log_line(LOG_DEBUG, "Free Memory:  %llu MB", ((totalPages - used_pages) * PMM_PAGE_SIZE) / 1024 / 1024);
+    log_line(LOG_DEBUG, "Watermarks:   min %llu low %llu high %llu pages", watermarks[PMM_WMARK_MIN], watermarks[PMM_WMARK_LOW], watermarks[PMM_WMARK_HIGH]);
+    log_line(LOG_DEBUG, "LRU:          %llu active %llu inactive pages", lru_sizes[1], lru_sizes[0]);
     log_line(LOG_DEBUG, "-----------------------------");
 }
 
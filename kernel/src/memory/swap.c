@@ -0,0 +1,228 @@
+#include <cpu.h>
+#include <common/logging.h>
+#include <devices/block.h>
+#include <libk/string.h>
+#include <memory/hhdm.h>
+#include <memory/kheap.h>
+#include <memory/paging.h>
+#include <memory/swap.h>
+#include <memory/zswap.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// There's a single swap area
+static struct swap_area swap;
+
+/**
+ * @brief Enables swap on a block device
+ * The whole device is used, its previous content is lost
+ * @param dev The block device
+ * @return true if swap was enabled
+ */
+bool swap_on(struct block_device *dev)
+{
+    if(!dev || swap.dev) return false;
+
+    uint64_t nr_slots = dev->sector_count * dev->sector_size / PAGING_PAGE_SIZE;
+    if(!nr_slots || PAGING_PAGE_SIZE % dev->sector_size) return false;
+
+    // Both are touched while reclaiming, they must never be demand paged
+    uint16_t *map = kmalloc_contig(nr_slots * sizeof(uint16_t), NULL);
+    uint8_t *buffer = kmalloc_contig(SWAP_CLUSTER_MAX * PAGING_PAGE_SIZE, NULL);
+    if(!map || !buffer)
+    {
+        log_line(LOG_WARN, "%s: Not enough memory to swap on %s", __FUNCTION__, dev->name);
+        kfree_contig(map);
+        kfree_contig(buffer);
+        return false;
+    }
+    memset(map, 0x00, nr_slots * sizeof(uint16_t));
+
+    // Without it every page goes to the device
+    zswap_init(nr_slots);
+
+    swap.map = map;
+    swap.buffer = buffer;
+    swap.nr_slots = nr_slots;
+    swap.nr_free = nr_slots;
+    swap.next = 0;
+    swap.dev = dev;
+
+    log_line(LOG_SUCCESS, "%s: Swapping on %s, %llu KB", __FUNCTION__, dev->name, nr_slots * PAGING_PAGE_SIZE / 1024);
+    return true;
+}
+
+/**
+ * @brief Tells if there's a swap area
+ * 
+ * @return true if swap is on
+ */
+bool swap_enabled(void)
+{
+    return swap.dev != NULL;
+}
+
+/**
+ * @brief Allocates a run of contiguous slots
+ * The search continues from the end of the previous run, so the clusters
+ * written one after the other end up next to each other
+ * @param slot Filled with the first slot of the run
+ * @param count How many slots we'd like, at most SWAP_CLUSTER_MAX
+ * @return uint64_t How many slots were allocated (less than count if the free space is fragmented), 0 if swap is full
+ */
+uint64_t swap_alloc(uint64_t *slot, uint64_t count)
+{
+    if(!swap.dev || !swap.nr_free || !count) return 0;
+
+    // Find the first free slot, there's one
+    uint64_t first = swap.next;
+    while(swap.map[first]) first = (first + 1) % swap.nr_slots;
+
+    uint64_t run = 0;
+    while(run < count && first + run < swap.nr_slots && !swap.map[first + run])
+    {
+        swap.map[first + run] = 1;
+        run++;
+    }
+
+    swap.nr_free -= run;
+    swap.next = (first + run) % swap.nr_slots;
+
+    *slot = first;
+    return run;
+}
+
+/**
+ * @brief Adds a reference to a slot, when a swap entry is copied
+ * 
+ * @param slot The slot
+ */
+void swap_dup(uint64_t slot)
+{
+    if(slot >= swap.nr_slots || !swap.map[slot]) return;
+
+    if(swap.map[slot] == SWAP_MAP_MAX)
+    {
+        log_line(LOG_ERROR, "%s: Too many references to swap slot %llu", __FUNCTION__, slot);
+        hcf();
+    }
+
+    swap.map[slot]++;
+}
+
+/**
+ * @brief Drops a reference to a slot, the last one frees it
+ * 
+ * @param slot The slot
+ */
+void swap_free(uint64_t slot)
+{
+    if(slot >= swap.nr_slots || !swap.map[slot]) return;
+
+    if(--swap.map[slot] == 0)
+    {
+        swap.nr_free++;
+        zswap_invalidate(slot);
+    }
+}
+
+/**
+ * @brief Writes pages to a run of slots
+ * The pages are compressed in memory first, the ones that don't compress
+ * are written with a request per run of contiguous slots
+ * @param slot The first slot
+ * @param frames The physical addresses of the pages
+ * @param count How many pages, at most SWAP_CLUSTER_MAX
+ * @return true if the write succeeded
+ */
+bool swap_write_pages(uint64_t slot, uint64_t *frames, uint64_t count)
+{
+    if(!swap.dev || count > SWAP_CLUSTER_MAX) return false;
+
+    uint64_t sectors_per_slot = PAGING_PAGE_SIZE / swap.dev->sector_size;
+    uint64_t run = 0; // Pages in the bounce buffer waiting for the device
+
+    for(uint64_t i = 0; i <= count; i++)
+    {
+        if(i < count && !zswap_store(slot + i, frames[i]))
+        {
+            memcpy(swap.buffer + run * PAGING_PAGE_SIZE, hhdm_physToVirt((void *)frames[i]), PAGING_PAGE_SIZE);
+            run++;
+            continue;
+        }
+
+        // A compressed page (or the end) breaks the run
+        if(!run) continue;
+
+        if(!block_write(swap.dev, (slot + i - run) * sectors_per_slot, run * sectors_per_slot, swap.buffer)) return false;
+        swap.writes++;
+        run = 0;
+    }
+
+    swap.pages_out += count;
+    return true;
+}
+
+/**
+ * @brief Reads a run of slots
+ * The compressed pages are decompressed, the others are read with a single
+ * request that spans from the first to the last of them
+ * @param slot The first slot
+ * @param frames The physical addresses of the pages to fill
+ * @param count How many pages, at most SWAP_CLUSTER_MAX
+ * @return true if the read succeeded
+ */
+bool swap_read_pages(uint64_t slot, uint64_t *frames, uint64_t count)
+{
+    if(!swap.dev || count > SWAP_CLUSTER_MAX) return false;
+
+    bool loaded[SWAP_CLUSTER_MAX];
+    uint64_t first = count, last = 0;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        // The page never reached the device, if it can't be decompressed there's nothing to fall back to
+        loaded[i] = zswap_stored(slot + i);
+        if(loaded[i] && !zswap_load(slot + i, frames[i])) return false;
+        if(loaded[i]) continue;
+
+        if(first == count) first = i;
+        last = i;
+    }
+
+    if(first < count)
+    {
+        uint64_t sectors_per_slot = PAGING_PAGE_SIZE / swap.dev->sector_size;
+        uint64_t run = last - first + 1;
+        if(!block_read(swap.dev, (slot + first) * sectors_per_slot, run * sectors_per_slot, swap.buffer)) return false;
+
+        for(uint64_t i = first; i <= last; i++)
+        {
+            if(loaded[i]) continue;
+            memcpy(hhdm_physToVirt((void *)frames[i]), swap.buffer + (i - first) * PAGING_PAGE_SIZE, PAGING_PAGE_SIZE);
+        }
+
+        swap.reads++;
+    }
+
+    swap.pages_in += count;
+    return true;
+}
+
+/**
+ * @brief Prints the swap usage and counters on the serial port
+ */
+void swap_print_stats(void)
+{
+    if(!swap.dev)
+    {
+        log_line(LOG_DEBUG, "%s: Swap is off", __FUNCTION__);
+        return;
+    }
+
+    log_line(LOG_DEBUG, "%s: %s, %llu of %llu KB used", __FUNCTION__, swap.dev->name,
+        (swap.nr_slots - swap.nr_free) * PAGING_PAGE_SIZE / 1024, swap.nr_slots * PAGING_PAGE_SIZE / 1024);
+    log_line(LOG_DEBUG, "%s: %llu pages out in %llu writes, %llu pages in with %llu reads", __FUNCTION__,
+        swap.pages_out, swap.writes, swap.pages_in, swap.reads);
+    zswap_print_stats();
+}
@@ -3,8 +3,10 @@
 #include <memory/kheap.h>
 #include <memory/paging.h>
 #include <memory/pmm.h>
+#include <memory/swap.h>
 #include <memory/vmm.h>
 #include <common/logging.h>
+#include <devices/timer.h>
 #include <cpu.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -14,10 +16,100 @@
 // The kernel and the current virrtual address space
 static struct vm_address_space *kernel_vas = NULL, *current_vas = NULL;
 
+// Reads of never written anonymous memory map this frame read only
+static uint64_t zero_page_phys = 0;
+
+// The pcids are handed out in order, when they run out a new generation starts
+// and every address space gets a new one the next time it's switched to
+static uint64_t pcid_generation = 1;
+static uint16_t pcid_next = 1; // 0 is the kernel pcid
+
+// Transparent huge pages, the background scan resumes from where it stopped
+static bool thp_enabled = true;
+static struct vm_address_space *thp_scan_space = NULL;
+static uint64_t thp_scan_addr = 0;
+static uint64_t thp_last_scan_ms = 0;
+static uint64_t ws_last_scan_ms = 0;
+
+// How many pages a demand fault maps
+static uint64_t fault_around_pages = VMM_FAULT_AROUND_DEFAULT;
+
+// Same page merging, the background scan resumes from where it stopped
+static bool ksm_enabled = true;
+static struct vm_address_space *ksm_scan_space = NULL;
+static uint64_t ksm_scan_addr = 0;
+static uint64_t ksm_last_scan_ms = 0;
+static struct vmm_ksm_stable_node *ksm_stable[VMM_KSM_STABLE_BUCKETS];
+static struct vmm_ksm_candidate ksm_unstable[VMM_KSM_UNSTABLE_SIZE];
+static struct vmm_ksm_stable_node *ksm_spare_node; // Allocated before a page is examined, the allocation may reclaim
+static struct vmm_ksm_stats ksm_stats;
+static uint64_t ksm_zero_hash = 0;
+
+// Background reclaim, it runs from the low to the high watermark
+static bool kswapd_running = false;
+static uint64_t kswapd_sleep_until_ms = 0;
+static struct vmm_reclaim_stats reclaim_stats;
+
+// Ranges advised as needed soon, they're mapped from the idle loop in order
+static struct vmm_willneed_range willneed_queue[VMM_WILLNEED_QUEUE];
+static uint64_t willneed_count = 0;
+
+static bool vmm_populate_range(struct vm_address_space *space, struct vm_area *area, uint64_t start, uint64_t end);
+
+/**
+ * @brief Aligns an address up
+ * 
+ * @param addr The address
+ * @param align The alignment, a power of 2
+ * @return uint64_t The first multiple of align >= addr
+ */
+static inline uint64_t vmm_align_up(uint64_t addr, uint64_t align)
+{
+    return (addr + align - 1) & ~(align - 1);
+}
+
+/**
+ * @brief Tells if an area with these flags can be backed by huge pages
+ * Only demand paged (anonymous) memory, MMIO is mapped as requested.
+ * The advice on the area wins over the global setting
+ * @param flags The generic flags of the area
+ * @return true if huge pages can be used
+ */
+static inline bool vmm_thp_allowed(uint64_t flags)
+{
+    if(flags & (VMM_FLAGS_MMIO | VMM_FLAGS_NOHUGEPAGE)) return false;
+
+    return thp_enabled || (flags & VMM_FLAGS_HUGEPAGE);
+}
+
+/**
+ * @brief Tells if a 2MB window lies entirely inside an area that allows huge pages
+ * 
+ * @param area The area
+ * @param base The 2MB aligned start of the window
+ * @return true if the window can be a huge page
+ */
+static inline bool vmm_thp_window_fits(struct vm_area *area, uint64_t base)
+{
+    return vmm_thp_allowed(area->flags) && base >= area->base && base + PAGING_HUGE_PAGE_SIZE <= area->base + area->size;
+}
+
+/**
+ * @brief Tells if a page can be dropped instead of being written to swap
+ * 
+ * @param entry The page table entry of the page
+ * @return true if the page was lazily freed and it wasn't written since
+ */
+static inline bool vmm_lazy_freed(uint64_t entry)
+{
+    return (entry & PTE_FLAG_LAZY_FREE) && !(entry & (PTE_FLAG_DIRTY | PTE_FLAG_SOFT_DIRTY));
+}
+
 /**
  * @brief Our virtual memory manager initialization function
  * 1) Creates the kernel VAS
  * 2) Set it to be the current VAS
+ * 3) Allocates the shared zero page
  */
 void vmm_init(void)
 {
@@ -31,11 +123,26 @@ void vmm_init(void)
 
     // Set the base root
     kernel_vas->pml4_phys = paging_getKernelRoot();
-    kernel_vas->region_list = NULL;
+    kernel_vas->area_tree.node = NULL;
+    kernel_vas->pcid = 0;
+    kernel_vas->pcid_generation = 0; // The kernel pcid never changes
+    memset(&kernel_vas->working_set, 0x00, sizeof(kernel_vas->working_set));
 
     // Set the current vas as the kernel
     current_vas = kernel_vas;
 
+    // The zero page keeps our reference forever, so unmapping it never frees it
+    zero_page_phys = pmm_alloc(PAGING_PAGE_SIZE);
+    if(!zero_page_phys)
+    {
+        log_line(LOG_ERROR, "%s: Cannot allocate the zero page", __FUNCTION__);
+        hcf();
+    }
+    memset(hhdm_physToVirt((void *)zero_page_phys), 0x00, PAGING_PAGE_SIZE);
+
+    // Failed allocations reclaim the mapped pages
+    pmm_set_reclaimer(vmm_reclaim_pages);
+
     log_line(LOG_SUCCESS, "%s: Virtual memory manager initialized", __FUNCTION__);
 }
 
@@ -61,7 +168,10 @@ struct vm_address_space *vmm_new_address_space(void)
 
     // Set the correct fields
     new_address_space->pml4_phys = (uint64_t *) new_pml4;
-    new_address_space->region_list = NULL;
+    new_address_space->area_tree.node = NULL;
+    new_address_space->pcid = 0;
+    new_address_space->pcid_generation = 0; // Assigned on the first switch
+    memset(&new_address_space->working_set, 0x00, sizeof(new_address_space->working_set));
 
     // Set all the entries as non present
     uint64_t *virt_new_pml4 = hhdm_physToVirt((void *) new_pml4);
@@ -69,7 +179,7 @@ struct vm_address_space *vmm_new_address_space(void)
 
     // Copy the higher half since the kernel and everything else should be always mapped into every VAS
     uint64_t *virt_kernel_pml4 = hhdm_physToVirt(kernel_vas->pml4_phys);
-    for(size_t i = 256; i < 512; i++)
+    for(size_t i = PAGING_PML4_KERNEL_INDEX; i < 512; i++)
     {
         virt_new_pml4[i] = virt_kernel_pml4[i];
     }
@@ -77,10 +187,241 @@ struct vm_address_space *vmm_new_address_space(void)
     return new_address_space;
 }
  
+/**
+ * @brief Returns the lowest address areas of an address space can start at
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @return uint64_t The start of the kernel or of the user region
+ */
+static inline uint64_t vmm_space_start(struct vm_address_space *space)
+{
+    return space == kernel_vas ? VMM_KERNEL_START : VMM_USER_START;
+}
+
+/**
+ * @brief Returns the area of a tree node
+ * 
+ * @param node The node, can be NULL
+ * @return struct vm_area* The area or NULL
+ */
+static inline struct vm_area *vmm_node_to_area(struct rb_node *node)
+{
+    return node ? rb_entry(node, struct vm_area, node) : NULL;
+}
+
+/**
+ * @brief Returns the area with the lowest base
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @return struct vm_area* The first area, NULL if there are none
+ */
+static inline struct vm_area *vmm_first_area(struct vm_address_space *space)
+{
+    return vmm_node_to_area(rb_first(&space->area_tree));
+}
+
+/**
+ * @brief Returns the area that follows another one
+ * 
+ * @param area The current area
+ * @return struct vm_area* The next area, NULL if it was the last one
+ */
+static inline struct vm_area *vmm_next_area(struct vm_area *area)
+{
+    return vmm_node_to_area(rb_next(&area->node));
+}
+
+/**
+ * @brief Augment callback of the area tree
+ * The value of a node is the largest gap among itself and its subtrees
+ * @param node The node to update
+ */
+static void vmm_area_augment(struct rb_node *node)
+{
+    struct vm_area *area = vmm_node_to_area(node);
+    uint64_t max_gap = area->gap;
+
+    if(node->left && vmm_node_to_area(node->left)->subtree_gap > max_gap)
+        max_gap = vmm_node_to_area(node->left)->subtree_gap;
+    if(node->right && vmm_node_to_area(node->right)->subtree_gap > max_gap)
+        max_gap = vmm_node_to_area(node->right)->subtree_gap;
+
+    area->subtree_gap = max_gap;
+}
+
+/**
+ * @brief Recomputes the gap before an area, after its predecessor changed
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param area The area, can be NULL
+ */
+static void vmm_area_update_gap(struct vm_address_space *space, struct vm_area *area)
+{
+    if(!area) return;
+
+    struct vm_area *prev = vmm_node_to_area(rb_prev(&area->node));
+    area->gap = area->base - (prev ? prev->base + prev->size : vmm_space_start(space));
+
+    rb_augment_propagate(&area->node, vmm_area_augment);
+}
+
+/**
+ * @brief Inserts an area in the tree of an address space
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param new_area The area, it must not overlap other areas
+ */
+static void vmm_insert_area(struct vm_address_space *space, struct vm_area *new_area)
+{
+    struct rb_node **link = &space->area_tree.node;
+    struct rb_node *parent = NULL;
+
+    while(*link)
+    {
+        parent = *link;
+        link = new_area->base < vmm_node_to_area(parent)->base ? &parent->left : &parent->right;
+    }
+
+    rb_link_node(&new_area->node, parent, link);
+
+    struct vm_area *prev = vmm_node_to_area(rb_prev(&new_area->node));
+    new_area->gap = new_area->base - (prev ? prev->base + prev->size : vmm_space_start(space));
+    new_area->subtree_gap = new_area->gap;
+
+    rb_insert_color(&new_area->node, &space->area_tree, vmm_area_augment);
+
+    // The next area now starts its gap at the end of the new one
+    vmm_area_update_gap(space, vmm_next_area(new_area));
+}
+
+/**
+ * @brief Removes an area from the tree of an address space
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param area The area to remove
+ */
+static void vmm_remove_area(struct vm_address_space *space, struct vm_area *area)
+{
+    struct vm_area *next = vmm_next_area(area);
+
+    rb_erase(&area->node, &space->area_tree, vmm_area_augment);
+
+    // Its gap merges into the one of the next area
+    vmm_area_update_gap(space, next);
+}
+
+/**
+ * @brief Tells if two areas can become a single one
+ * Device memory isn't merged, each area maps its own physical range
+ * @param area The first area
+ * @param next The area that follows it
+ * @return true if next starts where area ends and they have the same flags
+ */
+static inline bool vmm_can_merge(struct vm_area *area, struct vm_area *next)
+{
+    if(area->flags != next->flags || (area->flags & (VMM_FLAGS_MMIO | VMM_FLAGS_NOMERGE))) return false;
+
+    return area->base + area->size == next->base;
+}
+
+/**
+ * @brief Merges an area with the areas next to it, where they're compatible
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param area The area
+ * @return struct vm_area* The area that now contains it, the other structs are freed
+ */
+static struct vm_area *vmm_merge_area(struct vm_address_space *space, struct vm_area *area)
+{
+    struct vm_area *prev = vmm_node_to_area(rb_prev(&area->node));
+    if(prev && vmm_can_merge(prev, area))
+    {
+        vmm_remove_area(space, area);
+        prev->size += area->size;
+        vmm_area_update_gap(space, vmm_next_area(prev));
+
+        kfree(area);
+        area = prev;
+    }
+
+    struct vm_area *next = vmm_next_area(area);
+    if(next && vmm_can_merge(area, next))
+    {
+        vmm_remove_area(space, next);
+        area->size += next->size;
+        vmm_area_update_gap(space, vmm_next_area(area));
+
+        kfree(next);
+    }
+
+    return area;
+}
+
+/**
+ * @brief Finds the lowest free hole that fits a new area
+ * Subtrees whose largest gap is too small are skipped entirely
+ * @param node The root of the subtree to search
+ * @param size The size of the new area
+ * @param align The alignment of the new area
+ * @param result Filled with the base of the new area
+ * @return true if a hole between two areas was found
+ * @note The space after the last area isn't a gap, the caller checks it
+ */
+static bool vmm_find_gap(struct rb_node *node, uint64_t size, uint64_t align, uint64_t *result)
+{
+    if(!node) return false;
+
+    struct vm_area *area = vmm_node_to_area(node);
+    if(area->subtree_gap < size) return false;
+
+    // Lower addresses first
+    if(vmm_find_gap(node->left, size, align, result)) return true;
+
+    uint64_t candidate = vmm_align_up(area->base - area->gap, align);
+    if(candidate + size <= area->base && candidate >= area->base - area->gap)
+    {
+        *result = candidate;
+        return true;
+    }
+
+    return vmm_find_gap(node->right, size, align, result);
+}
+
+/**
+ * @brief Finds the first area that ends after an address
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param vaddr The address
+ * @return struct vm_area* The area that contains vaddr or the first one after it, NULL if there is none
+ */
+static struct vm_area *vmm_lower_bound(struct vm_address_space *space, uint64_t vaddr)
+{
+    struct rb_node *node = space->area_tree.node;
+    struct vm_area *found = NULL;
+
+    while(node)
+    {
+        struct vm_area *area = vmm_node_to_area(node);
+        if(area->base + area->size > vaddr)
+        {
+            found = area;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
 /**
  * @brief Our vmm allocator
  * This function finds an available region in the virtual address space
- * passed by argument and allocates it
+ * passed by argument and allocates it. The lowest hole that fits is found
+ * in O(log n) thanks to the gaps stored in the area tree. The new region
+ * becomes part of the areas next to it if they have the same flags
  * @param space Pointer to a valid vm_address_space struct
  * @param size The number of bytes to allocate, aligned to next page boundary
  * @param flags Generic flags to be applied to the pages of this areas
@@ -111,28 +452,20 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
         region_search_end = VMM_USER_END;
     }
 
-    // Search for a free space in the virtual address space
-    struct vm_area *current = space->region_list;
-    struct vm_area *prev = NULL;
-    uint64_t candidate = region_search_start;
+    // Areas that can hold huge pages start on a 2MB boundary
+    uint64_t align = PAGING_PAGE_SIZE;
+    if(vmm_thp_allowed(flags) && size >= PAGING_HUGE_PAGE_SIZE) align = PAGING_HUGE_PAGE_SIZE;
 
-    while(current != NULL)
+    // Search for a free space in the virtual address space
+    uint64_t candidate;
+    if(!vmm_find_gap(space->area_tree.node, size, align, &candidate))
     {
-        // We found a free hole
-        if(current->base >= candidate + size)
-        {
-            // We must not surpass the higher half region
-            if(candidate + size <= region_search_end) break;
-        }
-
-        // We position ourselves after the block
-        candidate = current->base + current->size;
+        // No hole between the areas, we position ourselves after the last one
+        struct vm_area *last = vmm_node_to_area(rb_last(&space->area_tree));
+        candidate = vmm_align_up(last ? last->base + last->size : region_search_start, align);
 
-        // OOM virtual
-        if(candidate >= region_search_end) return NULL;
-
-        prev = current;
-        current = current->next;
+        // OOM virtual, we must not surpass the region
+        if(candidate >= region_search_end || candidate + size > region_search_end) return NULL;
     }
 
     // Allocate the new area in the kernel heap
@@ -141,17 +474,16 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
 
     new_area->base = candidate;
     new_area->size = size;
-    new_area->flags = flags;
-    new_area->next = current;
+    new_area->flags = flags & ~VMM_FLAGS_POPULATE; // Only a hint for the allocation, it would keep the area from merging
+    vmm_insert_area(space, new_area);
 
-    // If it's the first area
-    if(prev == NULL)
-    {
-        space->region_list = new_area;
-    }
-    else 
+    // Pre-fault the whole area, it's going to be used right away
+    if(!(flags & VMM_FLAGS_MMIO) && (flags & VMM_FLAGS_POPULATE))
     {
-        prev->next = new_area;
+        if(!vmm_populate_range(space, new_area, new_area->base, new_area->base + size))
+        {
+            log_line(LOG_WARN, "%s: Out of memory, 0x%llx - 0x%llx is left to demand paging", __FUNCTION__, new_area->base, new_area->base + size);
+        }
     }
 
     // If it's mapping for memory mapped I/O we map the physical address immediately
@@ -180,12 +512,14 @@ void *vmm_alloc(struct vm_address_space *space, uint64_t size, uint64_t flags, u
         log_line(LOG_DEBUG, "VMM: Lazy Allocation at v=0x%llx (Phys: None yet)", candidate);
     }
 
-    return (void *) new_area->base;
+    vmm_merge_area(space, new_area);
+
+    return (void *) candidate;
 }
 
 /**
  * @brief Function for returning the area a virtual address belongs to
- * 
+ * It's a search in the area tree, O(log n)
  * @param space Pointer to a valid vm_address_space struct
  * @param vaddr The virtual address belonging to the vm area we want
  * @return struct vm_area* A pointer to the vm_area that contains vaddr
@@ -195,70 +529,49 @@ struct vm_area *vmm_get_vm_area(struct vm_address_space *space, uint64_t vaddr)
 {
     if(!space) return NULL;
 
-    // Iterate the areas of the VAS
-    struct vm_area *current = space->region_list;
-    while(current != NULL)
+    struct rb_node *node = space->area_tree.node;
+    while(node != NULL)
     {
-        // If the virtual address is inside the area we return that
-        if(vaddr >= current->base && vaddr < current->base + current->size)
-        {
-            return current;
-        }
-        current = current->next;
+        struct vm_area *current = vmm_node_to_area(node);
+
+        if(vaddr < current->base)
+            node = node->left;
+        else if(vaddr >= current->base + current->size)
+            node = node->right;
+        else
+            return current; // The virtual address is inside the area
     }
 
     return NULL;
 }
 
 /**
- * @brief Function for removing the page mapping of a block
+ * @brief Removes an area and the page mapping of its region
  * 
- * @param space The address space we're interested in
- * @param addr The base address of the virtual memory region
+ * @param space The address space of the area
+ * @param area The area
  */
-void vmm_free(struct vm_address_space *space, uint64_t addr)
+static void vmm_unmap_area(struct vm_address_space *space, struct vm_area *area)
 {
-    if(!space || !addr) return;
-
-    struct vm_area *current = space->region_list;
-    struct vm_area *prev = NULL;
-
-    while(current != NULL)
-    {
-        // We found the region
-        if(current->base == addr)
-        {
-            // Delete it from the list
-            if(prev == NULL)
-            {
-                space->region_list = current->next;
-            }
-            else 
-            {
-                prev->next = current->next;
-            }
-
-            // Unmap the region in the page tables
-            paging_unmap_region(hhdm_physToVirt(space->pml4_phys), 
-                current->base, 
-                current->size,
-                false,
-                !(current->flags & VMM_FLAGS_MMIO)); // Free the physical page only if the mapped area is not MMIO
+    // Delete it from the tree
+    vmm_remove_area(space, area);
 
-            kfree(current);
-            return;
-        }
+    // Unmap the region in the page tables
+    paging_unmap_region(hhdm_physToVirt(space->pml4_phys), 
+        area->base, 
+        area->size,
+        false,
+        !(area->flags & VMM_FLAGS_MMIO)); // Free the physical page only if the mapped area is not MMIO
 
-        prev = current;
-        current = current->next;
-    }
+    // The invlpg only reached the current pcid
+    if(space != current_vas) vmm_pcid_invalidate(space);
 
-    log_line(LOG_WARN, "%s: Attempted to free an invalid region: 0x%llx", __FUNCTION__, addr);
+    kfree(area);
 }
 
 /**
  * @brief This function free's everything about a VAS
- * 1) It unmaps every area described by the vm_area list
+ * 1) It unmaps every area described by the vm_area tree
  * 2) It frees the vm_area structs
  * 3) It decrements the usage of the pml4
  * 4) It frees the addess space struct  
@@ -268,14 +581,24 @@ void vmm_destroy_address_space(struct vm_address_space *space)
 {
     if(!space || space == kernel_vas) return;
 
-    struct vm_area *current = space->region_list;
-    
     // Free each area
-    while(current != NULL)
+    struct vm_area *current;
+    while((current = vmm_first_area(space)) != NULL)
+    {
+        vmm_unmap_area(space, current);
+    }
+
+    // The merge candidates can't point to it anymore
+    if(ksm_scan_space == space) ksm_scan_space = NULL;
+    memset(ksm_unstable, 0x00, sizeof(ksm_unstable));
+
+    // Nor can the ranges waiting to be prefaulted
+    for(uint64_t i = 0; i < willneed_count; )
     {
-        struct vm_area *next = current->next;
-        vmm_free(space, current->base);
-        current = next;
+        if(willneed_queue[i].space == space)
+            willneed_queue[i] = willneed_queue[--willneed_count];
+        else
+            i++;
     }
 
     // Decrement the usage of that table
@@ -285,6 +608,52 @@ void vmm_destroy_address_space(struct vm_address_space *space)
     kfree(space);
 }
 
+/**
+ * @brief Duplicates an address space with copy on write
+ * The areas are copied and the anonymous pages are shared read only by both
+ * address spaces, only the page tables are duplicated. The first write to
+ * a shared page gives the writer its own copy
+ * @param space A pointer to a valid (not the kernel) address space
+ * @return struct vm_address_space* The new address space, NULL if we ran out of memory
+ */
+struct vm_address_space *vmm_clone_address_space(struct vm_address_space *space)
+{
+    if(!space || space == kernel_vas) return NULL;
+
+    struct vm_address_space *clone = vmm_new_address_space();
+    if(!clone) return NULL;
+
+    uint64_t *src_pml4 = hhdm_physToVirt(space->pml4_phys);
+    uint64_t *dst_pml4 = hhdm_physToVirt(clone->pml4_phys);
+
+    for(struct vm_area *area = vmm_first_area(space); area != NULL; area = vmm_next_area(area))
+    {
+        struct vm_area *copy = kmalloc(sizeof(struct vm_area));
+        if(!copy)
+        {
+            vmm_destroy_address_space(clone);
+            return NULL;
+        }
+
+        copy->base = area->base;
+        copy->size = area->size;
+        copy->flags = area->flags;
+        vmm_insert_area(clone, copy);
+
+        // Device memory isn't counted, it's simply mapped in both
+        if(!paging_clone_region(src_pml4, dst_pml4, area->base, area->size, !(area->flags & VMM_FLAGS_MMIO)))
+        {
+            vmm_destroy_address_space(clone);
+            return NULL;
+        }
+    }
+
+    // The source lost the write permission, its tlb entries still have it
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    return clone;
+}
+
 /**
  * @brief Function to convert generic paging flags to x86 specific
  * 
@@ -308,48 +677,373 @@ uint64_t vmm_generic_to_x86_flags(uint64_t genericFlags)
 }
 
 /**
- * @brief Our page fault handler
- * When interrupt 0xe (14) is fired that means there was a problem accessing
- * a byte inside a specific page. This problem is either resolvable (because with
- * demand paging we delay the actual physical allocation until the memory is accessed)
- * so we simply allocate a physical page through our pmm and retry executing the instruction OR
- * it was the process fault, accessing a page it shouldn't have. 
- * @param context The state of the process before firing the page fault
+ * @brief Maps a zeroed huge page on the 2MB window containing an address
+ * The window must fit in the area and nothing must be mapped there yet
+ * @param pml4 The virtual address (HHDM) of the pml4 of the address space
+ * @param area The area of the address
+ * @param vaddr The address
+ * @return true if the huge page was mapped
  */
-void vmm_page_fault_handler(struct isr_context *context)
+static bool vmm_map_anon_huge(uint64_t *pml4, struct vm_area *area, uint64_t vaddr)
 {
-    // Cr2 is the address who caused the page fault
-    uint64_t cr2;
-    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    uint64_t huge_base = vaddr & ~(PAGING_HUGE_PAGE_SIZE - 1);
+    if(!vmm_thp_window_fits(area, huge_base)) return false;
 
-    // What caused the fault?
-    bool present = context->error_code & PAGE_FAULT_PRESENT;
-    bool write = context->error_code & PAGE_FAULT_WRITE;
-    bool execute = context->error_code & PAGE_FAULT_INSTRUCTION_FETCH;
-    bool user = context->error_code & PAGE_FAULT_USER;
-    log_line(LOG_DEBUG, "PF at 0x%llx (Present: %d, Write: %d, Execute: %d, User: %d)", cr2, present, write, execute, user);
+    int level;
+    uint64_t *entry = paging_get_entry(pml4, huge_base, &level);
+    if(level < PAGING_LEVEL_PD || (level == PAGING_LEVEL_PD && *entry)) return false;
 
-    // The page fault was in user space or kernel space?
-    struct vm_address_space *target_vas;
-    if(cr2 >= VMM_KERNEL_START)
+    // No free 2MB block, small pages will do
+    uint64_t phys_huge = pmm_alloc(PAGING_HUGE_PAGE_SIZE);
+    if(!phys_huge) return false;
+
+    memset(hhdm_physToVirt((void *)phys_huge), 0x00, PAGING_HUGE_PAGE_SIZE);
+    paging_map_page(pml4, huge_base, phys_huge, vmm_generic_to_x86_flags(area->flags), true);
+
+    return true;
+}
+
+/**
+ * @brief Maps zeroed pages on the unmapped pages of a range
+ * The frames come from bulk allocations of up to VMM_FAULT_AROUND_MAX pages
+ * @param pml4 The virtual address (HHDM) of the pml4 of the address space
+ * @param area The area the range belongs to
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if every unmapped page was mapped, false if we ran out of memory
+ */
+static bool vmm_map_anon_range(uint64_t *pml4, struct vm_area *area, uint64_t start, uint64_t end)
+{
+    uint64_t x86_flags = vmm_generic_to_x86_flags(area->flags);
+    uint64_t missing[VMM_FAULT_AROUND_MAX];
+    uint64_t frames[VMM_FAULT_AROUND_MAX];
+
+    while(start < end)
     {
-        target_vas = kernel_vas;
+        // Gather the next unmapped pages
+        uint64_t count = 0;
+        for(; start < end && count < VMM_FAULT_AROUND_MAX; start += PAGING_PAGE_SIZE)
+        {
+            uint64_t *entry = paging_get_entry(pml4, start, NULL);
+            if(!*entry) missing[count++] = start;
+        }
+
+        uint64_t allocated = pmm_alloc_bulk(frames, count);
+        for(uint64_t i = 0; i < allocated; i++)
+        {
+            // Zero the page, fundamental for security
+            memset(hhdm_physToVirt((void *)frames[i]), 0x00, PAGING_PAGE_SIZE);
+            paging_map_page(pml4, missing[i], frames[i], x86_flags, false);
+        }
+
+        if(allocated < count) return false;
     }
-    else 
+
+    return true;
+}
+
+/**
+ * @brief Maps the shared zero page read only on the unmapped pages of a range
+ * 
+ * @param pml4 The virtual address (HHDM) of the pml4 of the address space
+ * @param area The area the range belongs to
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ */
+static void vmm_map_zero_range(uint64_t *pml4, struct vm_area *area, uint64_t start, uint64_t end)
+{
+    // The first write faults and goes through copy on write
+    uint64_t x86_flags = vmm_generic_to_x86_flags(area->flags) & ~PTE_FLAG_RW;
+
+    for(; start < end; start += PAGING_PAGE_SIZE)
     {
-        target_vas = current_vas;
+        if(*paging_get_entry(pml4, start, NULL)) continue;
+
+        paging_map_page(pml4, start, zero_page_phys, x86_flags, false);
+        pmm_page_inc_ref(zero_page_phys);
     }
+}
 
-    struct vm_area *target_area = vmm_get_vm_area(target_vas, cr2);
-    
-    // The memory was not mapped
-    if(!target_area)
-    {
-        log_line(LOG_ERROR, "SEGFAULT: Access to unmapped memory at 0x%llx (RIP: 0x%llx)", cr2, context->rip);
+/**
+ * @brief Puts the private 4KB pages of a range on the LRU lists
+ * Huge pages, shared pages and the zero page aren't tracked
+ * @param space The address space of the range
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ */
+static void vmm_lru_track(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+
+    for(; start < end; start += PAGING_PAGE_SIZE)
+    {
+        int level;
+        uint64_t *entry = paging_get_entry(pml4, start, &level);
+        if(level != PAGING_LEVEL_PT || !(*entry & PTE_FLAG_PRESENT)) continue;
+
+        uint64_t phys = *entry & PAGING_PTE_ADDR_MASK;
+        struct pmm_page *page = pmm_phys_to_page(phys);
+        if(page && page->ref_count == 1) pmm_lru_add(phys, space, start);
+    }
+}
+
+/**
+ * @brief Reads back a run of swapped out pages that sit in contiguous slots
+ * The run starts at addr and grows while the next page is in the next slot,
+ * so it's read with a single request
+ * @param pml4 The virtual address (HHDM) of the pml4 of the address space
+ * @param area The area the pages belong to
+ * @param addr The first page of the run, it must hold a swap entry
+ * @param end Where the run must stop (excluded)
+ * @return uint64_t How many pages were read back, 0 if we're out of memory or the read failed
+ */
+static uint64_t vmm_swap_in_run(uint64_t *pml4, struct vm_area *area, uint64_t addr, uint64_t end)
+{
+    uint64_t slot = PTE_SWAP_SLOT(*paging_get_entry(pml4, addr, NULL));
+
+    uint64_t count = 1;
+    while(count < SWAP_CLUSTER_MAX && addr + count * PAGING_PAGE_SIZE < end)
+    {
+        uint64_t entry = *paging_get_entry(pml4, addr + count * PAGING_PAGE_SIZE, NULL);
+        if(!PTE_IS_SWAP(entry) || PTE_SWAP_SLOT(entry) != slot + count) break;
+        count++;
+    }
+
+    // With less memory we read a shorter run, the slots are still contiguous
+    uint64_t frames[SWAP_CLUSTER_MAX];
+    count = pmm_alloc_bulk(frames, count);
+    if(!count) return 0;
+
+    if(!swap_read_pages(slot, frames, count))
+    {
+        for(uint64_t i = 0; i < count; i++) pmm_page_dec_ref(frames[i]);
+        return 0;
+    }
+
+    // Every page gets a private copy, so the slots can go
+    uint64_t x86_flags = vmm_generic_to_x86_flags(area->flags);
+    for(uint64_t i = 0; i < count; i++)
+    {
+        paging_map_page(pml4, addr + i * PAGING_PAGE_SIZE, frames[i], x86_flags, false);
+        swap_free(slot + i);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Resolves a fault on a swapped out page
+ * The faulting page is read first, then the swapped out pages of the window
+ * as readahead, which stops at the first failure
+ * @param space The address space of the fault
+ * @param area The area of the fault
+ * @param vaddr The faulting address
+ * @param start The first address of the readahead window
+ * @param end The end of the readahead window (excluded)
+ * @return true if the faulting page was read back
+ */
+static bool vmm_swap_in(struct vm_address_space *space, struct vm_area *area, uint64_t vaddr, uint64_t start, uint64_t end)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    uint64_t page = vaddr & ~(PAGING_PAGE_SIZE - 1);
+
+    if(!vmm_swap_in_run(pml4, area, page, page + PAGING_PAGE_SIZE)) return false;
+
+    for(uint64_t addr = start; addr < end; )
+    {
+        if(!PTE_IS_SWAP(*paging_get_entry(pml4, addr, NULL)))
+        {
+            addr += PAGING_PAGE_SIZE;
+            continue;
+        }
+
+        uint64_t read = vmm_swap_in_run(pml4, area, addr, end);
+        if(!read) break;
+
+        reclaim_stats.swap_readahead += read;
+        addr += read * PAGING_PAGE_SIZE;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Maps a range of an area, with huge pages where possible
+ * Swapped out pages are read back, the unmapped ones are zeroed.
+ * If memory runs out the rest of the range is left to demand paging
+ * @param space Pointer to a valid vm_address_space struct
+ * @param area The area the range belongs to
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if the whole range was mapped, false if we ran out of memory
+ */
+static bool vmm_populate_range(struct vm_address_space *space, struct vm_area *area, uint64_t start, uint64_t end)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    uint64_t addr = start;
+
+    while(addr < end)
+    {
+        if(!(addr % PAGING_HUGE_PAGE_SIZE) && addr + PAGING_HUGE_PAGE_SIZE <= end && vmm_map_anon_huge(pml4, area, addr))
+        {
+            addr += PAGING_HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        // Small pages up to the next 2MB boundary
+        uint64_t next = vmm_align_up(addr + 1, PAGING_HUGE_PAGE_SIZE);
+        if(next > end) next = end;
+
+        bool mapped = true;
+        for(uint64_t page = addr; page < next && mapped; )
+        {
+            if(!PTE_IS_SWAP(*paging_get_entry(pml4, page, NULL)))
+            {
+                page += PAGING_PAGE_SIZE;
+                continue;
+            }
+
+            uint64_t read = vmm_swap_in_run(pml4, area, page, next);
+            mapped = read != 0;
+            page += read * PAGING_PAGE_SIZE;
+        }
+
+        mapped = mapped && vmm_map_anon_range(pml4, area, addr, next);
+        vmm_lru_track(space, addr, next);
+
+        if(!mapped) return false;
+
+        addr = next;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Resolves a write fault on a copy on write page
+ * If other address spaces still share the frame the writer gets its own copy,
+ * otherwise it's the last owner and the write permission is simply restored
+ * @param space The address space of the fault
+ * @param area The area of the fault
+ * @param vaddr The faulting address
+ * @return true if the fault was resolved, false if it wasn't a copy on write fault
+ */
+static bool vmm_resolve_cow(struct vm_address_space *space, struct vm_area *area, uint64_t vaddr)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    int level;
+    uint64_t *entry = paging_get_entry(pml4, vaddr, &level);
+
+    if(!(*entry & PTE_FLAG_PRESENT) || (*entry & PTE_FLAG_RW) || level > PAGING_LEVEL_PD) return false;
+
+    bool huge = level == PAGING_LEVEL_PD;
+    uint64_t page_size = huge ? PAGING_HUGE_PAGE_SIZE : PAGING_PAGE_SIZE;
+    uint64_t old_phys = *entry & PAGING_PTE_ADDR_MASK & ~(page_size - 1);
+    uint64_t x86_flags = vmm_generic_to_x86_flags(area->flags);
+
+    struct pmm_page *page = pmm_phys_to_page(old_phys);
+    if(!page) return false;
+
+    // The zero page is never exclusive, the vmm keeps a reference to it
+    if(page->ref_count == 1)
+    {
+        // We're the only owner left
+        paging_change_page_flags(pml4, vaddr, x86_flags, huge);
+        if(!huge) vmm_lru_track(space, vaddr & ~(PAGING_PAGE_SIZE - 1), (vaddr & ~(PAGING_PAGE_SIZE - 1)) + PAGING_PAGE_SIZE);
+        return true;
+    }
+
+    uint64_t new_phys = pmm_alloc(page_size);
+    if(!new_phys)
+    {
+        log_line(LOG_ERROR, "%s: OOM Cannot copy the page at 0x%llx, nothing left to reclaim", __FUNCTION__, vaddr);
+        hcf();
+    }
+
+    if(old_phys == zero_page_phys)
+        memset(hhdm_physToVirt((void *)new_phys), 0x00, page_size);
+    else
+        memcpy(hhdm_physToVirt((void *)new_phys), hhdm_physToVirt((void *)old_phys), page_size);
+
+    // Replace the shared translation, then drop our reference to the shared frame
+    paging_map_page(pml4, vaddr, new_phys, x86_flags, huge);
+    pmm_page_dec_ref(old_phys);
+
+    if(!huge) vmm_lru_track(space, vaddr & ~(PAGING_PAGE_SIZE - 1), (vaddr & ~(PAGING_PAGE_SIZE - 1)) + PAGING_PAGE_SIZE);
+
+    return true;
+}
+
+/**
+ * @brief Changes how many pages a demand fault maps
+ * The pages around the faulting one that belong to the same area are mapped too,
+ * so sequential first touches take one fault per window
+ * @param pages The window size, rounded down to a power of 2 and capped to VMM_FAULT_AROUND_MAX,
+ * 1 disables fault-around
+ */
+void vmm_set_fault_around(uint64_t pages)
+{
+    if(pages > VMM_FAULT_AROUND_MAX) pages = VMM_FAULT_AROUND_MAX;
+
+    uint64_t window = 1;
+    while(window * 2 <= pages) window *= 2;
+
+    fault_around_pages = window;
+}
+
+/**
+ * @brief Our page fault handler
+ * When interrupt 0xe (14) is fired that means there was a problem accessing
+ * a byte inside a specific page. This problem is either resolvable (because with
+ * demand paging we delay the actual physical allocation until the memory is accessed)
+ * so we simply allocate a physical page through our pmm and retry executing the instruction OR
+ * it was the process fault, accessing a page it shouldn't have. 
+ * @param context The state of the process before firing the page fault
+ */
+void vmm_page_fault_handler(struct isr_context *context)
+{
+    // Cr2 is the address who caused the page fault
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+    // What caused the fault?
+    bool present = context->error_code & PAGE_FAULT_PRESENT;
+    bool write = context->error_code & PAGE_FAULT_WRITE;
+    bool execute = context->error_code & PAGE_FAULT_INSTRUCTION_FETCH;
+    bool user = context->error_code & PAGE_FAULT_USER;
+    log_line(LOG_DEBUG, "PF at 0x%llx (Present: %d, Write: %d, Execute: %d, User: %d)", cr2, present, write, execute, user);
+
+    // The page fault was in user space or kernel space?
+    struct vm_address_space *target_vas;
+    if(cr2 >= VMM_KERNEL_START)
+    {
+        target_vas = kernel_vas;
+    }
+    else 
+    {
+        target_vas = current_vas;
+    }
+
+    struct vm_area *target_area = vmm_get_vm_area(target_vas, cr2);
+    
+    // The memory was not mapped
+    if(!target_area)
+    {
+        log_line(LOG_ERROR, "SEGFAULT: Access to unmapped memory at 0x%llx (RIP: 0x%llx)", cr2, context->rip);
         // TODO: kill the offending process
         hcf();
     }
 
+    // Copy on write, the area is writable but the page is shared read only
+    if(present && write && (target_area->flags & VMM_FLAGS_WRITE) && !(target_area->flags & VMM_FLAGS_MMIO))
+    {
+        if(vmm_resolve_cow(target_vas, target_area, cr2))
+        {
+            log_line(LOG_DEBUG, "%s: Resolved copy on write at 0x%llx", __FUNCTION__, cr2);
+            return;
+        }
+    }
+
     // If the page was present that means it's a permission violation
     if (present) {
         if (write && !(target_area->flags & VMM_FLAGS_WRITE)) {
@@ -365,31 +1059,73 @@ void vmm_page_fault_handler(struct isr_context *context)
         hcf();
     }
 
-    // Demand paging
-    uint64_t phys_page = pmm_alloc(PAGING_PAGE_SIZE);
-    if(!phys_page)
+    uint64_t *pml4 = hhdm_physToVirt(target_vas->pml4_phys);
+
+    // Fault-around, the aligned window that belongs to the area
+    uint64_t window = fault_around_pages * PAGING_PAGE_SIZE;
+    if(target_area->flags & VMM_FLAGS_RANDOM) window = PAGING_PAGE_SIZE;
+    if(target_area->flags & VMM_FLAGS_SEQUENTIAL) window = VMM_FAULT_AROUND_MAX * PAGING_PAGE_SIZE;
+
+    // Sequential accesses don't go back, the window starts at the fault
+    uint64_t start = cr2 & ~(window - 1);
+    if(target_area->flags & VMM_FLAGS_SEQUENTIAL) start = cr2 & ~(PAGING_PAGE_SIZE - 1);
+    uint64_t end = start + window;
+    if(start < target_area->base) start = target_area->base;
+    if(end > target_area->base + target_area->size) end = target_area->base + target_area->size;
+
+    // The page was swapped out, its swapped out neighbours in the window are read ahead
+    if(PTE_IS_SWAP(*paging_get_entry(pml4, cr2, NULL)))
+    {
+        if(!vmm_swap_in(target_vas, target_area, cr2, start, end))
+        {
+            log_line(LOG_ERROR, "%s: Cannot swap in the page at 0x%llx", __FUNCTION__, cr2);
+            hcf();
+        }
+
+        vmm_lru_track(target_vas, start, end);
+
+        log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx from swap", __FUNCTION__, cr2);
+        return;
+    }
+
+    // Transparent huge page, the whole 2MB window belongs to the area and nothing is mapped there yet.
+    // Reads try it too, with the zero page an area read before being written would never get one
+    if(vmm_map_anon_huge(pml4, target_area, cr2))
     {
-        // TODO: Implement swap memory mechainsm so this never happens
-        log_line(LOG_ERROR, "%s: OOM Cannot allocate a page", __FUNCTION__);
+        log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx with a huge page", __FUNCTION__, cr2);
+        return;
+    }
+
+    // A read of never written memory, it costs no memory until the first write
+    if(!write)
+    {
+        vmm_map_zero_range(pml4, target_area, start, end);
+
+        log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx with the zero page", __FUNCTION__, cr2);
+        return;
+    }
+
+    // Demand paging, the faulting page first so it's the one we get if memory is scarce
+    uint64_t page = cr2 & ~(PAGING_PAGE_SIZE - 1);
+    if(!vmm_map_anon_range(pml4, target_area, page, page + PAGING_PAGE_SIZE))
+    {
+        log_line(LOG_ERROR, "%s: OOM Cannot allocate a page, nothing left to reclaim", __FUNCTION__);
         hcf();
     }
 
-    // Zero the page, fundamental for security
-    memset(hhdm_physToVirt((void *)phys_page), 0x00, PAGING_PAGE_SIZE);
-    
-    // Map the page
-    paging_map_page(hhdm_physToVirt(target_vas->pml4_phys), 
-        cr2, 
-        phys_page,
-        vmm_generic_to_x86_flags(target_area->flags),
-        false);
+    // The rest of the window
+    if(end - start > PAGING_PAGE_SIZE) vmm_map_anon_range(pml4, target_area, start, end);
+
+    // Only now, the allocations above may reclaim and the faulting page wasn't touched yet
+    vmm_lru_track(target_vas, start, end);
     
-    log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx -> Alloc Phys 0x%llx", __FUNCTION__,cr2, phys_page);
+    log_line(LOG_DEBUG, "%s: Recovered Fault at 0x%llx (window 0x%llx - 0x%llx)", __FUNCTION__, cr2, start, end);
 }
 
 /**
  * @brief Switch the current address space
- * 
+ * With PCIDs the tlb entries of the address space survive the switch,
+ * they're flushed only when the address space gets a new pcid
  * @param space A pointer to the vm_address_space we want to switch to
  */
 void vmm_switch_address_space(struct vm_address_space *space)
@@ -399,8 +1135,46 @@ void vmm_switch_address_space(struct vm_address_space *space)
     // Set it as the current VAS
     current_vas = space;
 
+    // The kernel always owns pcid 0, and its mappings are global anyway
+    if(space == kernel_vas)
+    {
+        paging_switch_context_pcid(space->pml4_phys, 0, false);
+        return;
+    }
+
+    bool flush = false;
+    if(space->pcid_generation != pcid_generation)
+    {
+        // All the pcids of this generation are taken, start a new one
+        if(pcid_next == PAGING_PCID_COUNT)
+        {
+            pcid_generation++;
+            pcid_next = 1;
+        }
+
+        space->pcid = pcid_next++;
+        space->pcid_generation = pcid_generation;
+
+        // The tlb can still hold translations of the previous owner of the pcid
+        flush = true;
+    }
+
     // Change the CR3 register
-    paging_switch_context(space->pml4_phys);
+    paging_switch_context_pcid(space->pml4_phys, space->pcid, flush);
+}
+
+/**
+ * @brief Drops the pcid of an address space
+ * Used when its mappings change while it's not the current one, since invlpg
+ * only invalidates the current pcid. It will get a new pcid, flushing the tlb,
+ * the next time it's switched to
+ * @param space A pointer to the vm_address_space
+ */
+void vmm_pcid_invalidate(struct vm_address_space *space)
+{
+    if(!space || space == kernel_vas) return;
+
+    space->pcid_generation = 0;
 }
 
 /**
@@ -412,4 +1186,1274 @@ void vmm_switch_address_space(struct vm_address_space *space)
 struct vm_address_space* vmm_get_kernel_vas()
 {
     return kernel_vas;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Getter for the shared zero page
+ * 
+ * @return uint64_t The physical address of the zero page
+ */
+uint64_t vmm_get_zero_page(void)
+{
+    return zero_page_phys;
+}
+
+/**
+ * @brief Prints the areas of an address space and how they're mapped, on the serial port
+ * For a process only the lower half is dumped, the higher half is the kernel one
+ * @param space A pointer to the vm_address_space
+ */
+void vmm_dump_address_space(struct vm_address_space *space)
+{
+    if(!space) return;
+
+    for(struct vm_area *area = vmm_first_area(space); area != NULL; area = vmm_next_area(area))
+    {
+        log_line(LOG_DEBUG, "%s: Area 0x%llx - 0x%llx flags 0x%llx", __FUNCTION__, area->base, area->base + area->size, area->flags);
+    }
+
+    if(space == kernel_vas)
+        paging_dump(hhdm_physToVirt(space->pml4_phys), 0, UINT64_MAX);
+    else
+        paging_dump(hhdm_physToVirt(space->pml4_phys), VMM_USER_START, VMM_USER_END);
+}
+
+/**
+ * @brief Harvests the accessed and dirty bits of every area of an address space
+ * The result replaces the working set statistics of the address space
+ * @param space A pointer to the vm_address_space
+ */
+void vmm_scan_working_set(struct vm_address_space *space)
+{
+    if(!space) return;
+
+    struct paging_access_stats stats;
+    memset(&stats, 0x00, sizeof(stats));
+
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    for(struct vm_area *area = vmm_first_area(space); area != NULL; area = vmm_next_area(area))
+    {
+        // Device memory isn't part of the working set
+        if(area->flags & VMM_FLAGS_MMIO) continue;
+
+        paging_scan_accessed(pml4, area->base, area->size, &stats);
+    }
+
+    // Its tlb entries still say accessed and dirty, the cpu wouldn't set the bits again
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    space->working_set = stats;
+}
+
+/**
+ * @brief Returns the working set of an address space
+ * 
+ * @param space A pointer to the vm_address_space
+ * @return uint64_t The bytes accessed between the last two scans
+ */
+uint64_t vmm_get_working_set_size(struct vm_address_space *space)
+{
+    if(!space) return 0;
+
+    return space->working_set.accessed * PAGING_PAGE_SIZE;
+}
+
+/**
+ * @brief Prints the working set statistics of an address space on the serial port
+ * 
+ * @param space A pointer to the vm_address_space
+ */
+void vmm_print_working_set(struct vm_address_space *space)
+{
+    if(!space) return;
+
+    struct paging_access_stats *ws = &space->working_set;
+    log_line(LOG_DEBUG, "%s: Resident %llu KB, working set %llu KB, dirtied %llu KB", __FUNCTION__,
+        ws->resident * PAGING_PAGE_SIZE / 1024, ws->accessed * PAGING_PAGE_SIZE / 1024, ws->dirty * PAGING_PAGE_SIZE / 1024);
+
+    for(size_t age = 0; age <= PTE_AGE_MAX; age++)
+    {
+        log_line(LOG_DEBUG, "%s: Idle for %llu scans%s: %llu KB", __FUNCTION__, age, age == PTE_AGE_MAX ? " or more" : "", ws->age_histogram[age] * PAGING_PAGE_SIZE / 1024);
+    }
+}
+
+/**
+ * @brief Enables or disables transparent huge pages
+ * 
+ * @param enabled If false faults map only 4KB pages and nothing is collapsed,
+ * the huge pages already mapped stay. Areas advised VMM_ADVICE_HUGEPAGE still get them
+ */
+void vmm_set_transparent_huge_pages(bool enabled)
+{
+    thp_enabled = enabled;
+}
+
+/**
+ * @brief Replaces the 4KB pages of a 2MB window with a single huge page
+ * The present pages are copied and the missing ones (or the zero page) are zeroed,
+ * then the old pages and their page table are released
+ * @param space The address space of the window
+ * @param area The area the window belongs to
+ * @param base The 2MB aligned start of the window
+ * @return true if the window was collapsed
+ */
+static bool vmm_thp_collapse(struct vm_address_space *space, struct vm_area *area, uint64_t base)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    int level;
+    uint64_t *pt = paging_get_entry(pml4, base, &level);
+
+    // Already a huge page or nothing mapped
+    if(level != PAGING_LEVEL_PT) return false;
+
+    // Not worth the memory if most of the window was never touched
+    struct pmm_page *pt_page = pmm_phys_to_page((uint64_t)hhdm_virtToPhys(pt));
+    if(!pt_page || pt_page->table_entries < VMM_THP_COLLAPSE_MIN_PTES) return false;
+
+    // Every page must be a plain mapping with the flags of the area, or the read only zero page
+    uint64_t x86_flags = vmm_generic_to_x86_flags(area->flags);
+    for(size_t i = 0; i < 512; i++)
+    {
+        if(!pt[i]) continue;
+
+        uint64_t pte_flags = pt[i] & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK;
+        if(pte_flags == (x86_flags | PTE_FLAG_PRESENT)) continue;
+        if((pt[i] & PAGING_PTE_ADDR_MASK) == zero_page_phys && pte_flags == ((x86_flags & ~PTE_FLAG_RW) | PTE_FLAG_PRESENT)) continue;
+
+        return false;
+    }
+
+    uint64_t phys_huge = pmm_alloc(PAGING_HUGE_PAGE_SIZE);
+    if(!phys_huge) return false;
+
+    uint8_t *huge = hhdm_physToVirt((void *)phys_huge);
+    for(size_t i = 0; i < 512; i++)
+    {
+        if(pt[i] && (pt[i] & PAGING_PTE_ADDR_MASK) != zero_page_phys)
+            memcpy(huge + i * PAGING_PAGE_SIZE, hhdm_physToVirt((void *)(pt[i] & PAGING_PTE_ADDR_MASK)), PAGING_PAGE_SIZE);
+        else
+            memset(huge + i * PAGING_PAGE_SIZE, 0x00, PAGING_PAGE_SIZE);
+    }
+
+    // Drop the small pages (and the now empty page table) and install the huge one
+    paging_unmap_region(pml4, base, PAGING_HUGE_PAGE_SIZE, true, true);
+    paging_map_page(pml4, base, phys_huge, x86_flags, true);
+
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    log_line(LOG_DEBUG, "%s: Collapsed 0x%llx into huge page 0x%llx", __FUNCTION__, base, phys_huge);
+    return true;
+}
+
+/**
+ * @brief Looks for 2MB windows that can be collapsed into huge pages
+ * The scan goes through the areas of the kernel and of the current address space,
+ * each call resumes from where the previous one stopped
+ * @param windows The maximum number of windows to examine
+ */
+void vmm_thp_collapse_scan(uint64_t windows)
+{
+    if(!kernel_vas) return;
+
+    // The address space we were scanning may not be the current one anymore
+    if(thp_scan_space != kernel_vas && thp_scan_space != current_vas)
+    {
+        thp_scan_space = kernel_vas;
+        thp_scan_addr = 0;
+    }
+
+    while(windows--)
+    {
+        // Find the first window after the cursor that fits in an area
+        uint64_t window = 0;
+        struct vm_area *area;
+        for(area = vmm_lower_bound(thp_scan_space, thp_scan_addr); area != NULL; area = vmm_next_area(area))
+        {
+            window = vmm_align_up(area->base > thp_scan_addr ? area->base : thp_scan_addr, PAGING_HUGE_PAGE_SIZE);
+            if(vmm_thp_window_fits(area, window)) break;
+        }
+
+        if(!area)
+        {
+            // This address space is done, move to the other one
+            thp_scan_space = thp_scan_space == kernel_vas ? current_vas : kernel_vas;
+            thp_scan_addr = 0;
+            return;
+        }
+
+        vmm_thp_collapse(thp_scan_space, area, window);
+        thp_scan_addr = window + PAGING_HUGE_PAGE_SIZE;
+    }
+}
+
+/**
+ * @brief Returns the entry that maps a page on the LRU lists
+ * 
+ * @param page The page struct
+ * @return uint64_t* The entry, NULL if the owner doesn't map the page there anymore
+ */
+static uint64_t *vmm_lru_entry(struct pmm_page *page)
+{
+    int level;
+    uint64_t *entry = paging_get_entry(hhdm_physToVirt(page->owner->pml4_phys), page->vaddr, &level);
+
+    if(level != PAGING_LEVEL_PT || !(*entry & PTE_FLAG_PRESENT)) return NULL;
+    if((*entry & PAGING_PTE_ADDR_MASK) != pmm_page_to_phys(page)) return NULL;
+
+    return entry;
+}
+
+/**
+ * @brief Tells if a page on the LRU lists was accessed since the last check
+ * 
+ * @param page The page struct
+ * @return true if the page was accessed
+ */
+static bool vmm_page_referenced(struct pmm_page *page)
+{
+    if(!paging_test_and_clear_young(hhdm_physToVirt(page->owner->pml4_phys), page->vaddr)) return false;
+
+    // The tlb entries of other address spaces still say accessed
+    if(page->owner != current_vas) vmm_pcid_invalidate(page->owner);
+
+    return true;
+}
+
+/**
+ * @brief Replaces a private page with a shared read only one, the private page is released
+ * The next write goes through copy on write
+ * @param space The address space of the page
+ * @param vaddr The address of the page
+ * @param entry The entry that maps the page
+ * @param new_phys The physical address of the shared page, it gets a new reference
+ */
+static void vmm_replace_page(struct vm_address_space *space, uint64_t vaddr, uint64_t *entry, uint64_t new_phys)
+{
+    uint64_t old_phys = *entry & PAGING_PTE_ADDR_MASK;
+    uint64_t x86_flags = *entry & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK & ~PTE_FLAG_RW;
+
+    pmm_page_inc_ref(new_phys);
+    paging_map_page(hhdm_physToVirt(space->pml4_phys), vaddr, new_phys, x86_flags, false);
+
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    pmm_page_dec_ref(old_phys);
+}
+
+/**
+ * @brief Writes an idle page to swap, together with the idle pages that follow it
+ * The cluster is written with a single request to contiguous slots, so swap-in
+ * readahead finds the neighbours next to each other
+ * @param page The page struct
+ * @return uint64_t How many pages were freed
+ */
+static uint64_t vmm_swap_out(struct pmm_page *page)
+{
+    struct vm_address_space *owner = page->owner;
+    uint64_t *pml4 = hhdm_physToVirt(owner->pml4_phys);
+    uint64_t vaddr = page->vaddr;
+
+    uint64_t frames[SWAP_CLUSTER_MAX];
+    frames[0] = pmm_page_to_phys(page);
+
+    uint64_t count = 1;
+    while(count < SWAP_CLUSTER_MAX)
+    {
+        // The next page must be private, inactive and idle too
+        int level;
+        uint64_t next_vaddr = vaddr + count * PAGING_PAGE_SIZE;
+        uint64_t *entry = paging_get_entry(pml4, next_vaddr, &level);
+        if(level != PAGING_LEVEL_PT || !(*entry & PTE_FLAG_PRESENT)) break;
+
+        struct pmm_page *next = pmm_phys_to_page(*entry & PAGING_PTE_ADDR_MASK);
+        if(!next || (next->flags & (PMM_FLAG_LRU | PMM_FLAG_ACTIVE)) != PMM_FLAG_LRU) break;
+        if(next->owner != owner || next->vaddr != next_vaddr) break;
+
+        // It will be dropped on its own, its content isn't needed
+        if(vmm_lazy_freed(*entry)) break;
+
+        if(vmm_page_referenced(next))
+        {
+            reclaim_stats.activated++;
+            pmm_lru_move(next, true);
+            break;
+        }
+
+        frames[count++] = *entry & PAGING_PTE_ADDR_MASK;
+    }
+
+    uint64_t slot;
+    count = swap_alloc(&slot, count);
+    if(!count) return 0;
+
+    if(!swap_write_pages(slot, frames, count))
+    {
+        log_line(LOG_WARN, "%s: Cannot write %llu pages to swap", __FUNCTION__, count);
+        for(uint64_t i = 0; i < count; i++) swap_free(slot + i);
+        return 0;
+    }
+
+    for(uint64_t i = 0; i < count; i++)
+    {
+        paging_set_swap_entry(pml4, vaddr + i * PAGING_PAGE_SIZE, PTE_MAKE_SWAP(slot + i));
+        pmm_page_dec_ref(frames[i]);
+    }
+
+    if(owner != current_vas) vmm_pcid_invalidate(owner);
+
+    return count;
+}
+
+/**
+ * @brief Tries to free an idle page
+ * A lazily freed page that's still clean is simply dropped, a page that holds
+ * only zeroes is replaced by the zero page, the others are written to swap.
+ * Kernel memory is never swapped out
+ * @param page The page struct
+ * @param entry The entry that maps the page
+ * @return uint64_t How many pages were freed, swap-out frees whole clusters
+ */
+static uint64_t vmm_pageout(struct pmm_page *page, uint64_t *entry)
+{
+    if(vmm_lazy_freed(*entry))
+    {
+        struct vm_address_space *owner = page->owner;
+
+        // The next access finds an empty page
+        paging_unmap_page(hhdm_physToVirt(owner->pml4_phys), page->vaddr, false, true);
+        if(owner != current_vas) vmm_pcid_invalidate(owner);
+
+        reclaim_stats.lazy_freed++;
+        return 1;
+    }
+
+    uint64_t phys = pmm_page_to_phys(page);
+    uint64_t *data = hhdm_physToVirt((void *)phys);
+
+    for(size_t i = 0; i < PAGING_PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        if(!data[i]) continue;
+
+        if(page->owner == kernel_vas || !swap_enabled()) return 0;
+        return vmm_swap_out(page);
+    }
+
+    vmm_replace_page(page->owner, page->vaddr, entry, zero_page_phys);
+    return 1;
+}
+
+/**
+ * @brief Frees pages from the LRU lists
+ * Each pass scans a bigger part of the lists, idle active pages are moved to the
+ * inactive list, referenced inactive pages get a second chance on the active list,
+ * the others are paged out
+ * @param pages How many pages we want to free
+ * @return uint64_t How many pages were freed
+ */
+static uint64_t vmm_shrink_lru(uint64_t pages)
+{
+    uint64_t freed = 0;
+    struct pmm_page *page;
+
+    for(int priority = VMM_RECLAIM_PRIORITY; priority >= 0 && freed < pages; priority--)
+    {
+        // Keep the inactive list at least as big as the active one
+        uint64_t active = pmm_lru_size(true);
+        if(active > pmm_lru_size(false))
+        {
+            uint64_t nr_scan = (active >> priority) ? (active >> priority) : 1;
+            while(nr_scan-- && (page = pmm_lru_tail(true)) != NULL)
+            {
+                if(!vmm_lru_entry(page))
+                {
+                    pmm_lru_del(page);
+                    continue;
+                }
+
+                bool referenced = vmm_page_referenced(page);
+                if(!referenced) reclaim_stats.deactivated++;
+                pmm_lru_move(page, referenced);
+            }
+        }
+
+        uint64_t inactive = pmm_lru_size(false);
+        uint64_t nr_scan = (inactive >> priority) ? (inactive >> priority) : 1;
+        while(nr_scan-- && freed < pages && (page = pmm_lru_tail(false)) != NULL)
+        {
+            reclaim_stats.scanned++;
+
+            uint64_t *entry = vmm_lru_entry(page);
+            if(!entry)
+            {
+                pmm_lru_del(page);
+                continue;
+            }
+
+            if(vmm_page_referenced(page))
+            {
+                reclaim_stats.activated++;
+                pmm_lru_move(page, true);
+                continue;
+            }
+
+            uint64_t paged_out = vmm_pageout(page, entry);
+            if(paged_out)
+            {
+                freed += paged_out;
+                continue;
+            }
+
+            // It can't be freed now, it goes back to the head of the list
+            pmm_lru_move(page, false);
+        }
+    }
+
+    reclaim_stats.reclaimed += freed;
+    return freed;
+}
+
+/**
+ * @brief Direct reclaim, called by the pmm when an allocation fails
+ * 
+ * @param pages How many pages the allocation is missing
+ * @return uint64_t How many pages were freed
+ */
+uint64_t vmm_reclaim_pages(uint64_t pages)
+{
+    reclaim_stats.direct_reclaims++;
+
+    uint64_t freed = vmm_shrink_lru(pages);
+    log_line(LOG_DEBUG, "%s: Freed %llu of %llu pages", __FUNCTION__, freed, pages);
+
+    return freed;
+}
+
+/**
+ * @brief The background reclaim
+ * It wakes up when free memory goes below the low watermark and frees
+ * VMM_KSWAPD_BATCH pages per call until it's above the high watermark,
+ * so allocations rarely have to reclaim themselves
+ */
+void vmm_kswapd(void)
+{
+    uint64_t now = timer_get_uptime_ms();
+
+    if(!kswapd_running)
+    {
+        if(now < kswapd_sleep_until_ms || pmm_get_free_pages() >= pmm_get_watermark(PMM_WMARK_LOW)) return;
+
+        kswapd_running = true;
+        reclaim_stats.kswapd_wakeups++;
+
+        // Free heap memory is the cheapest to give back
+        kheap_trim();
+    }
+
+    if(pmm_get_free_pages() >= pmm_get_watermark(PMM_WMARK_HIGH))
+    {
+        kswapd_running = false;
+        return;
+    }
+
+    // Like direct reclaim, the allocations of the pass (zswap, swap) mustn't reclaim again
+    if(!pmm_reclaim_enter()) return;
+
+    uint64_t freed = vmm_shrink_lru(VMM_KSWAPD_BATCH);
+    pmm_reclaim_exit();
+
+    if(!freed)
+    {
+        // Nothing can be freed right now, don't rescan the lists at every wake up
+        log_line(LOG_DEBUG, "%s: No progress with %llu free pages, sleeping", __FUNCTION__, pmm_get_free_pages());
+        kswapd_running = false;
+        kswapd_sleep_until_ms = now + VMM_KSWAPD_BACKOFF_MS;
+    }
+}
+
+/**
+ * @brief Prints the page reclaim counters on the serial port
+ */
+void vmm_print_reclaim_stats(void)
+{
+    log_line(LOG_DEBUG, "%s: LRU %llu active %llu inactive pages, %llu free pages (low %llu high %llu)", __FUNCTION__,
+        pmm_lru_size(true), pmm_lru_size(false), pmm_get_free_pages(), pmm_get_watermark(PMM_WMARK_LOW), pmm_get_watermark(PMM_WMARK_HIGH));
+    log_line(LOG_DEBUG, "%s: Scanned %llu, reclaimed %llu, activated %llu, deactivated %llu", __FUNCTION__,
+        reclaim_stats.scanned, reclaim_stats.reclaimed, reclaim_stats.activated, reclaim_stats.deactivated);
+    log_line(LOG_DEBUG, "%s: %llu kswapd wake ups, %llu direct reclaims, %llu pages of swap readahead, %llu lazily freed pages dropped", __FUNCTION__,
+        reclaim_stats.kswapd_wakeups, reclaim_stats.direct_reclaims, reclaim_stats.swap_readahead, reclaim_stats.lazy_freed);
+    swap_print_stats();
+}
+
+/**
+ * @brief Hashes the content of a page
+ * 
+ * @param data The page
+ * @return uint64_t The hash
+ */
+static uint64_t vmm_ksm_hash(const uint64_t *data)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for(size_t i = 0; i < PAGING_PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/**
+ * @brief Looks for a merged page with some content
+ * 
+ * @param hash The hash of the content
+ * @param data The content
+ * @return struct vmm_ksm_stable_node* The merged page, NULL if there's none
+ */
+static struct vmm_ksm_stable_node *vmm_ksm_stable_find(uint64_t hash, const void *data)
+{
+    struct vmm_ksm_stable_node *node = ksm_stable[hash & (VMM_KSM_STABLE_BUCKETS - 1)];
+
+    for(; node != NULL; node = node->next)
+    {
+        if(node->hash == hash && !memcmp(hhdm_physToVirt((void *)node->phys), data, PAGING_PAGE_SIZE)) return node;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Turns a private page into a merged page
+ * The page is write protected where it's mapped and the node takes a reference
+ * @param node The node of the merged page, already allocated
+ * @param candidate The candidate that maps the page
+ * @param entry The entry of the candidate
+ */
+static void vmm_ksm_stable_insert(struct vmm_ksm_stable_node *node, struct vmm_ksm_candidate *candidate, uint64_t *entry)
+{
+    node->hash = candidate->hash;
+    node->phys = candidate->phys;
+
+    uint64_t x86_flags = *entry & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK & ~PTE_FLAG_RW;
+    paging_map_page(hhdm_physToVirt(candidate->space->pml4_phys), candidate->vaddr, candidate->phys, x86_flags, false);
+    if(candidate->space != current_vas) vmm_pcid_invalidate(candidate->space);
+
+    // A shared page leaves the LRU lists
+    pmm_page_inc_ref(node->phys);
+
+    uint64_t bucket = node->hash & (VMM_KSM_STABLE_BUCKETS - 1);
+    node->next = ksm_stable[bucket];
+    ksm_stable[bucket] = node;
+}
+
+/**
+ * @brief Returns the private page an address maps, if it can be merged
+ * 
+ * @param space The address space
+ * @param vaddr The address
+ * @return uint64_t* The entry, NULL if the page is huge, shared, not present or written recently
+ */
+static uint64_t *vmm_ksm_entry(struct vm_address_space *space, uint64_t vaddr)
+{
+    int level;
+    uint64_t *entry = paging_get_entry(hhdm_physToVirt(space->pml4_phys), vaddr, &level);
+    if(level != PAGING_LEVEL_PT || !(*entry & PTE_FLAG_PRESENT)) return NULL;
+
+    // Pages written since the last harvest would be unmerged right away
+    if(*entry & PTE_FLAG_DIRTY) return NULL;
+
+    // Already shared, the zero page and merged pages included
+    struct pmm_page *page = pmm_phys_to_page(*entry & PAGING_PTE_ADDR_MASK);
+    if(!page || !(page->flags & PMM_FLAG_USED) || page->ref_count != 1 || page->order) return NULL;
+
+    return entry;
+}
+
+/**
+ * @brief Tries to merge a page
+ * Zero filled pages are replaced by the zero page, the others by a merged page
+ * with the same content. A page that matches a candidate of this pass turns the
+ * candidate into a merged page, otherwise it becomes a candidate itself
+ * @param space The address space
+ * @param vaddr The address of the page
+ */
+static void vmm_ksm_scan_page(struct vm_address_space *space, uint64_t vaddr)
+{
+    // Reclaim could swap out or free the pages and the entries we look at below
+    if(!ksm_spare_node) ksm_spare_node = kmalloc(sizeof(struct vmm_ksm_stable_node));
+
+    uint64_t *entry = vmm_ksm_entry(space, vaddr);
+    if(!entry) return;
+
+    uint64_t phys = *entry & PAGING_PTE_ADDR_MASK;
+    uint64_t *data = hhdm_physToVirt((void *)phys);
+    uint64_t hash = vmm_ksm_hash(data);
+    ksm_stats.pages_scanned++;
+
+    if(!ksm_zero_hash) ksm_zero_hash = vmm_ksm_hash(hhdm_physToVirt((void *)zero_page_phys));
+
+    if(hash == ksm_zero_hash && !memcmp(data, hhdm_physToVirt((void *)zero_page_phys), PAGING_PAGE_SIZE))
+    {
+        vmm_replace_page(space, vaddr, entry, zero_page_phys);
+        ksm_stats.zero_pages_merged++;
+        return;
+    }
+
+    struct vmm_ksm_stable_node *node = vmm_ksm_stable_find(hash, data);
+    if(node)
+    {
+        vmm_replace_page(space, vaddr, entry, node->phys);
+        ksm_stats.pages_merged++;
+        return;
+    }
+
+    // Open addressing on the hash
+    for(uint64_t i = 0; i < VMM_KSM_UNSTABLE_SIZE; i++)
+    {
+        struct vmm_ksm_candidate *candidate = &ksm_unstable[(hash + i) & (VMM_KSM_UNSTABLE_SIZE - 1)];
+
+        if(!candidate->space)
+        {
+            candidate->hash = hash;
+            candidate->space = space;
+            candidate->vaddr = vaddr;
+            candidate->phys = phys;
+            return;
+        }
+
+        if(candidate->hash != hash || candidate->phys == phys) continue;
+
+        // The candidate may have been written, unmapped or shared since we saw it
+        uint64_t *candidate_entry = vmm_ksm_entry(candidate->space, candidate->vaddr);
+        if(!candidate_entry || (*candidate_entry & PAGING_PTE_ADDR_MASK) != candidate->phys) continue;
+        if(memcmp(hhdm_physToVirt((void *)candidate->phys), data, PAGING_PAGE_SIZE)) continue;
+
+        // Out of memory, the pages stay private
+        if(!ksm_spare_node) return;
+
+        node = ksm_spare_node;
+        ksm_spare_node = NULL;
+        vmm_ksm_stable_insert(node, candidate, candidate_entry);
+
+        vmm_replace_page(space, vaddr, entry, node->phys);
+        ksm_stats.pages_merged++;
+
+        // Its page is in the stable table now, the slot stays taken so the probe chains hold
+        candidate->phys = 0;
+        return;
+    }
+}
+
+/**
+ * @brief Ends a pass of the scanner
+ * The candidates are forgotten and the merged pages nobody maps anymore are freed
+ */
+static void vmm_ksm_end_pass(void)
+{
+    memset(ksm_unstable, 0x00, sizeof(ksm_unstable));
+
+    for(size_t i = 0; i < VMM_KSM_STABLE_BUCKETS; i++)
+    {
+        struct vmm_ksm_stable_node **link = &ksm_stable[i];
+        while(*link)
+        {
+            struct vmm_ksm_stable_node *node = *link;
+            struct pmm_page *page = pmm_phys_to_page(node->phys);
+
+            if(page->ref_count > 1)
+            {
+                link = &node->next;
+                continue;
+            }
+
+            *link = node->next;
+            pmm_page_dec_ref(node->phys);
+            kfree(node);
+        }
+    }
+
+    ksm_stats.full_scans++;
+}
+
+/**
+ * @brief Enables or disables same page merging
+ * 
+ * @param enabled If false the scanner stops, the merged pages stay until they're written
+ */
+void vmm_set_ksm(bool enabled)
+{
+    ksm_enabled = enabled;
+}
+
+/**
+ * @brief Looks for identical pages in the mergeable areas
+ * The scan goes through the kernel and the current address space,
+ * each call resumes from where the previous one stopped
+ * @param pages The maximum number of pages to examine
+ */
+void vmm_ksm_scan(uint64_t pages)
+{
+    if(!ksm_enabled || !kernel_vas) return;
+
+    // The address space we were scanning may not be the current one anymore
+    if(ksm_scan_space != kernel_vas && ksm_scan_space != current_vas)
+    {
+        ksm_scan_space = kernel_vas;
+        ksm_scan_addr = 0;
+    }
+
+    while(pages--)
+    {
+        struct vm_area *area = vmm_lower_bound(ksm_scan_space, ksm_scan_addr);
+        while(area && (!(area->flags & VMM_FLAGS_MERGEABLE) || (area->flags & VMM_FLAGS_MMIO))) area = vmm_next_area(area);
+
+        if(!area)
+        {
+            // This address space is done, the pass ends after the current one
+            if(ksm_scan_space == kernel_vas && current_vas != kernel_vas)
+            {
+                ksm_scan_space = current_vas;
+            }
+            else
+            {
+                ksm_scan_space = kernel_vas;
+                vmm_ksm_end_pass();
+            }
+
+            ksm_scan_addr = 0;
+            return;
+        }
+
+        uint64_t vaddr = area->base > ksm_scan_addr ? area->base : ksm_scan_addr;
+        ksm_scan_addr = vaddr + PAGING_PAGE_SIZE;
+
+        // Huge pages aren't merged, skip them whole
+        int level;
+        uint64_t *entry = paging_get_entry(hhdm_physToVirt(ksm_scan_space->pml4_phys), vaddr, &level);
+        if(level == PAGING_LEVEL_PD && (*entry & PTE_FLAG_PRESENT))
+        {
+            ksm_scan_addr = vmm_align_up(ksm_scan_addr, PAGING_HUGE_PAGE_SIZE);
+            continue;
+        }
+
+        vmm_ksm_scan_page(ksm_scan_space, vaddr);
+    }
+}
+
+/**
+ * @brief Prints the same page merging counters on the serial port
+ */
+void vmm_print_ksm_stats(void)
+{
+    // Every mapping of a merged page but one is a page saved
+    uint64_t shared = 0, sharing = 0;
+    for(size_t i = 0; i < VMM_KSM_STABLE_BUCKETS; i++)
+    {
+        for(struct vmm_ksm_stable_node *node = ksm_stable[i]; node != NULL; node = node->next)
+        {
+            uint64_t mappings = pmm_phys_to_page(node->phys)->ref_count - 1;
+            shared++;
+            if(mappings > 1) sharing += mappings - 1;
+        }
+    }
+
+    log_line(LOG_DEBUG, "%s: %llu merged pages, %llu more mappings of them (%llu KB saved)", __FUNCTION__,
+        shared, sharing, sharing * PAGING_PAGE_SIZE / 1024);
+    log_line(LOG_DEBUG, "%s: Scanned %llu, merged %llu, merged into the zero page %llu, %llu full scans", __FUNCTION__,
+        ksm_stats.pages_scanned, ksm_stats.pages_merged, ksm_stats.zero_pages_merged, ksm_stats.full_scans);
+}
+
+/**
+ * @brief Splits the huge page that maps an address into 4KB pages
+ * The block is split too, so each page can be unmapped, swapped or freed on its own.
+ * A huge page shared with other address spaces is copied first, they keep the block.
+ * For device memory only the mapping is split
+ * @param space The address space
+ * @param vaddr The address
+ * @return true if the address isn't mapped by a huge page anymore, false if we ran out of memory
+ */
+static bool vmm_split_huge_page(struct vm_address_space *space, uint64_t vaddr)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    uint64_t base = vaddr & ~(PAGING_HUGE_PAGE_SIZE - 1);
+    int level;
+    uint64_t *entry = paging_get_entry(pml4, base, &level);
+
+    if(level != PAGING_LEVEL_PD || !(*entry & PTE_FLAG_PRESENT)) return true;
+
+    uint64_t phys = *entry & PAGING_PTE_ADDR_MASK & ~(PAGING_HUGE_PAGE_SIZE - 1);
+    struct pmm_page *page = pmm_phys_to_page(phys);
+    bool counted = page && (page->flags & PMM_FLAG_USED);
+
+    if(counted && page->ref_count > 1)
+    {
+        uint64_t copy = pmm_alloc(PAGING_HUGE_PAGE_SIZE);
+        if(!copy) return false;
+
+        // Still read only, the next write finds it private and restores the permission
+        memcpy(hhdm_physToVirt((void *)copy), hhdm_physToVirt((void *)phys), PAGING_HUGE_PAGE_SIZE);
+        paging_map_page(pml4, base, copy, *entry & ~PAGING_PTE_ADDR_MASK & ~PTE_USAGE_MASK & ~PTE_FLAG_PS, true);
+        pmm_page_dec_ref(phys);
+        phys = copy;
+    }
+
+    if(!paging_split_huge_page(pml4, base)) return false;
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    if(counted)
+    {
+        pmm_split_page(phys, 0);
+        vmm_lru_track(space, base, base + PAGING_HUGE_PAGE_SIZE);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Splits the huge pages that cross the ends of a range
+ * So the range can be changed without touching the memory around it
+ * @param space The address space
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if no huge page crosses the ends anymore, false if we ran out of memory
+ */
+static bool vmm_split_huge_ends(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    if(start % PAGING_HUGE_PAGE_SIZE && !vmm_split_huge_page(space, start)) return false;
+    if(end % PAGING_HUGE_PAGE_SIZE && !vmm_split_huge_page(space, end - 1)) return false;
+
+    return true;
+}
+
+/**
+ * @brief Splits an area in two at an address
+ * 
+ * @param space The address space of the area
+ * @param area The area
+ * @param addr Where the second part starts, page aligned and inside the area
+ * @return struct vm_area* The second part, NULL if the area is VMM_FLAGS_NOMERGE or we ran out of memory
+ */
+static struct vm_area *vmm_split_area(struct vm_address_space *space, struct vm_area *area, uint64_t addr)
+{
+    // Its owner relies on it being exactly one allocation
+    if(area->flags & VMM_FLAGS_NOMERGE)
+    {
+        log_line(LOG_WARN, "%s: Cannot split the area at 0x%llx at 0x%llx", __FUNCTION__, area->base, addr);
+        return NULL;
+    }
+
+    // Each part must map only its own memory
+    if(addr % PAGING_HUGE_PAGE_SIZE && !vmm_split_huge_page(space, addr)) return NULL;
+
+    struct vm_area *upper = kmalloc(sizeof(struct vm_area));
+    if(!upper) return NULL;
+
+    upper->base = addr;
+    upper->size = area->base + area->size - addr;
+    upper->flags = area->flags;
+
+    area->size = addr - area->base;
+    vmm_insert_area(space, upper);
+
+    return upper;
+}
+
+/**
+ * @brief Tells if a range is entirely allocated
+ * 
+ * @param space The address space
+ * @param start The first address of the range
+ * @param end The end of the range (excluded)
+ * @return true if there are no holes between the areas of the range
+ */
+static bool vmm_range_allocated(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    for(struct vm_area *area = vmm_lower_bound(space, start); area != NULL && start < end; area = vmm_next_area(area))
+    {
+        if(area->base > start) return false;
+        start = area->base + area->size;
+    }
+
+    return start >= end;
+}
+
+/**
+ * @brief Splits the areas that cross the ends of a range
+ * 
+ * @param space Pointer to a valid vm_address_space struct
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if every area is now either inside or outside the range, false if we ran out of memory
+ * @note On failure the areas are left as they were
+ */
+static bool vmm_split_range(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    struct vm_area *upper = NULL;
+    struct vm_area *area = vmm_lower_bound(space, start);
+    if(area && area->base < start && (upper = vmm_split_area(space, area, start)) == NULL) return false;
+
+    area = vmm_lower_bound(space, end - 1);
+    if(area && area->base < end && area->base + area->size > end && !vmm_split_area(space, area, end))
+    {
+        // Undo the first split, the two parts still have the same flags
+        if(upper) vmm_merge_area(space, upper);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Changes the flags of the areas of a range
+ * The areas that are only partly in the range are split first, so running out of
+ * memory changes nothing. Then each area is merged with its neighbours if they
+ * now have the same flags, a split that wasn't needed is undone that way
+ * @param space The address space
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @param set The flags to set
+ * @param clear The flags to clear
+ * @return true if the flags were changed, false if we ran out of memory
+ */
+static bool vmm_change_area_flags(struct vm_address_space *space, uint64_t start, uint64_t end, uint64_t set, uint64_t clear)
+{
+    // Nothing to do if every area already agrees, they aren't split for nothing
+    struct vm_area *area;
+    for(area = vmm_lower_bound(space, start); area != NULL && area->base < end; area = vmm_next_area(area))
+    {
+        if(((area->flags & ~clear) | set) != area->flags) break;
+    }
+    if(area == NULL || area->base >= end) return true;
+
+    if(!vmm_split_range(space, start, end)) return false;
+
+    for(area = vmm_lower_bound(space, start); area != NULL && area->base < end; area = vmm_next_area(area))
+    {
+        area->flags = (area->flags & ~clear) | set;
+        area = vmm_merge_area(space, area);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Frees the pages of a range, the areas stay
+ * The next access finds zeroed memory
+ * @param space The address space
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if the pages were freed, false if we ran out of memory
+ */
+static bool vmm_dontneed(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+
+    for(struct vm_area *area = vmm_lower_bound(space, start); area != NULL && area->base < end; area = vmm_next_area(area))
+    {
+        if(area->flags & VMM_FLAGS_MMIO) continue;
+
+        uint64_t range_start = area->base > start ? area->base : start;
+        uint64_t range_end = area->base + area->size < end ? area->base + area->size : end;
+        if(!vmm_split_huge_ends(space, range_start, range_end)) return false;
+
+        // Swap slots included
+        paging_unmap_region(pml4, range_start, range_end - range_start, false, true);
+    }
+
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    return true;
+}
+
+/**
+ * @brief Lazily frees the pages of a range
+ * The private pages are moved to the inactive list and reclaim drops them, instead of
+ * writing them to swap, unless they're written again first. Swapped out pages and
+ * whole huge pages aren't worth keeping, they're freed right away
+ * @param space The address space
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if the pages were freed, false if we ran out of memory
+ */
+static bool vmm_lazy_free(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+
+    for(struct vm_area *area = vmm_lower_bound(space, start); area != NULL && area->base < end; area = vmm_next_area(area))
+    {
+        if(area->flags & VMM_FLAGS_MMIO) continue;
+
+        uint64_t range_start = area->base > start ? area->base : start;
+        uint64_t range_end = area->base + area->size < end ? area->base + area->size : end;
+        if(!vmm_split_huge_ends(space, range_start, range_end)) return false;
+
+        for(uint64_t addr = range_start; addr < range_end; )
+        {
+            int level;
+            uint64_t *entry = paging_get_entry(pml4, addr, &level);
+
+            if(level > PAGING_LEVEL_PT)
+            {
+                // Huge pages aren't on the LRU lists, nothing would ever drop them
+                if(*entry & PTE_FLAG_PRESENT) paging_unmap_region(pml4, addr, PAGING_LEVEL_SIZE(level), true, true);
+
+                addr = vmm_align_up(addr + 1, PAGING_LEVEL_SIZE(level));
+                continue;
+            }
+
+            if(PTE_IS_SWAP(*entry))
+            {
+                paging_unmap_page(pml4, addr, false, true);
+            }
+            else if(*entry & PTE_FLAG_PRESENT)
+            {
+                // Shared pages are still needed by the others
+                struct pmm_page *page = pmm_phys_to_page(*entry & PAGING_PTE_ADDR_MASK);
+                if(page && (page->flags & PMM_FLAG_LRU) && paging_mark_lazy_free(pml4, addr)) pmm_lru_move(page, false);
+            }
+
+            addr += PAGING_PAGE_SIZE;
+        }
+    }
+
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    return true;
+}
+
+/**
+ * @brief Queues a range to be mapped from the idle loop
+ * 
+ * @param space The address space
+ * @param start The first address of the range, page aligned
+ * @param end The end of the range (excluded), page aligned
+ * @return true if the range was queued, false if the queue is full
+ */
+static bool vmm_willneed(struct vm_address_space *space, uint64_t start, uint64_t end)
+{
+    if(willneed_count == VMM_WILLNEED_QUEUE)
+    {
+        log_line(LOG_DEBUG, "%s: Too many ranges waiting, 0x%llx - 0x%llx is left to demand paging", __FUNCTION__, start, end);
+        return false;
+    }
+
+    struct vmm_willneed_range *range = &willneed_queue[willneed_count++];
+    range->space = space;
+    range->start = start;
+    range->end = end;
+
+    return true;
+}
+
+/**
+ * @brief Maps the next pages of the ranges advised with VMM_ADVICE_WILLNEED
+ * At most VMM_WILLNEED_BATCH pages per call, and only while memory isn't scarce
+ */
+static void vmm_willneed_work(void)
+{
+    // Prefaulting now would only give reclaim more work
+    if(!willneed_count || pmm_get_free_pages() < pmm_get_watermark(PMM_WMARK_HIGH)) return;
+
+    struct vmm_willneed_range *range = &willneed_queue[0];
+    uint64_t end = range->start + VMM_WILLNEED_BATCH * PAGING_PAGE_SIZE;
+    if(end > range->end) end = range->end;
+
+    // The areas may have been freed since the advice, only what's still there is mapped
+    bool mapped = true;
+    for(struct vm_area *area = vmm_lower_bound(range->space, range->start); area != NULL && area->base < end && mapped; area = vmm_next_area(area))
+    {
+        if(area->flags & VMM_FLAGS_MMIO) continue;
+
+        uint64_t range_start = area->base > range->start ? area->base : range->start;
+        uint64_t range_end = area->base + area->size < end ? area->base + area->size : end;
+        mapped = vmm_populate_range(range->space, area, range_start, range_end);
+    }
+
+    range->start = end;
+
+    // Done, or out of memory and the rest is left to demand paging
+    if(mapped && range->start < range->end) return;
+
+    willneed_count--;
+    memmove(&willneed_queue[0], &willneed_queue[1], willneed_count * sizeof(struct vmm_willneed_range));
+}
+
+/**
+ * @brief Tells the vmm how a range is going to be used
+ * Advice about how the range is accessed or backed is kept in the flags of its areas,
+ * the areas only partly in the range are split. Device memory is never freed or prefaulted
+ * @param space Pointer to a valid vm_address_space struct
+ * @param addr The start of the range, page aligned
+ * @param len The length of the range in bytes, aligned up to the next page
+ * @param advice One of VMM_ADVICE_*
+ * @return true if the advice was applied, false if part of the range isn't allocated,
+ * the advice is unknown or we ran out of memory
+ */
+bool vmm_advise(struct vm_address_space *space, uint64_t addr, uint64_t len, int advice)
+{
+    uint64_t end = vmm_align_up(addr + len, PAGING_PAGE_SIZE);
+    if(!space || !len || addr % PAGING_PAGE_SIZE || end <= addr) return false;
+
+    if(!vmm_range_allocated(space, addr, end))
+    {
+        log_line(LOG_WARN, "%s: 0x%llx - 0x%llx isn't allocated", __FUNCTION__, addr, end);
+        return false;
+    }
+
+    switch(advice)
+    {
+        case VMM_ADVICE_NORMAL:
+            return vmm_change_area_flags(space, addr, end, 0, VMM_FLAGS_SEQUENTIAL | VMM_FLAGS_RANDOM);
+        case VMM_ADVICE_RANDOM:
+            return vmm_change_area_flags(space, addr, end, VMM_FLAGS_RANDOM, VMM_FLAGS_SEQUENTIAL);
+        case VMM_ADVICE_SEQUENTIAL:
+            return vmm_change_area_flags(space, addr, end, VMM_FLAGS_SEQUENTIAL, VMM_FLAGS_RANDOM);
+        case VMM_ADVICE_MERGEABLE:
+            return vmm_change_area_flags(space, addr, end, VMM_FLAGS_MERGEABLE, 0);
+        case VMM_ADVICE_UNMERGEABLE:
+            return vmm_change_area_flags(space, addr, end, 0, VMM_FLAGS_MERGEABLE);
+        case VMM_ADVICE_HUGEPAGE:
+            return vmm_change_area_flags(space, addr, end, VMM_FLAGS_HUGEPAGE, VMM_FLAGS_NOHUGEPAGE);
+        case VMM_ADVICE_NOHUGEPAGE:
+            return vmm_change_area_flags(space, addr, end, VMM_FLAGS_NOHUGEPAGE, VMM_FLAGS_HUGEPAGE);
+        case VMM_ADVICE_WILLNEED:
+            return vmm_willneed(space, addr, end);
+        case VMM_ADVICE_DONTNEED:
+            return vmm_dontneed(space, addr, end);
+        case VMM_ADVICE_FREE:
+            return vmm_lazy_free(space, addr, end);
+        default:
+            log_line(LOG_WARN, "%s: Unknown advice %d", __FUNCTION__, advice);
+            return false;
+    }
+}
+
+/**
+ * @brief Unmaps a range, which can cover parts of areas or many of them
+ * The areas that cross the ends of the range are split, the holes are skipped
+ * @param space Pointer to a valid vm_address_space struct
+ * @param addr The start of the range, page aligned
+ * @param len The length of the range in bytes, aligned up to the next page
+ * @return true if the range was unmapped, false if the arguments are invalid or we ran out of memory
+ * @note Nothing is unmapped if the areas can't be split
+ */
+bool vmm_unmap(struct vm_address_space *space, uint64_t addr, uint64_t len)
+{
+    uint64_t end = vmm_align_up(addr + len, PAGING_PAGE_SIZE);
+    if(!space || !len || addr % PAGING_PAGE_SIZE || end <= addr) return false;
+
+    if(!vmm_split_range(space, addr, end)) return false;
+
+    struct vm_area *area = vmm_lower_bound(space, addr);
+    while(area != NULL && area->base < end)
+    {
+        struct vm_area *next = vmm_next_area(area);
+        vmm_unmap_area(space, area);
+        area = next;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Function for removing the page mapping of an allocation
+ * The area of an allocation may have been merged with its neighbours, so only
+ * the range of the allocation is unmapped and the rest of the area stays
+ * @param space The address space we're interested in
+ * @param addr The base address of the allocation, as returned by vmm_alloc
+ * @param len The size of the allocation, as passed to vmm_alloc
+ */
+void vmm_free(struct vm_address_space *space, uint64_t addr, uint64_t len)
+{
+    if(!space || !addr) return;
+
+    // The whole allocation must still be there
+    uint64_t end = vmm_align_up(addr + len, PAGING_PAGE_SIZE);
+    if(!len || end <= addr || !vmm_range_allocated(space, addr, end))
+    {
+        log_line(LOG_WARN, "%s: Attempted to free an invalid region: 0x%llx", __FUNCTION__, addr);
+        return;
+    }
+
+    if(!vmm_unmap(space, addr, len))
+    {
+        log_line(LOG_ERROR, "%s: Cannot free the region at 0x%llx", __FUNCTION__, addr);
+    }
+}
+
+/**
+ * @brief Changes the access permissions of a range
+ * The areas that cross the ends of the range are split, then the areas
+ * and the pages already mapped get the new permissions. Shared pages stay
+ * read only so the first write still copies them
+ * @param space Pointer to a valid vm_address_space struct
+ * @param addr The start of the range, page aligned
+ * @param len The length of the range in bytes, aligned up to the next page
+ * @param prot The new permissions, a combination of VMM_FLAGS_PROT_MASK that includes VMM_FLAGS_READ
+ * @return true if the permissions were changed, false if part of the range isn't allocated,
+ * the arguments are invalid or we ran out of memory
+ * @note A present page is always readable on x86, inaccessible pages aren't supported
+ */
+bool vmm_protect(struct vm_address_space *space, uint64_t addr, uint64_t len, uint64_t prot)
+{
+    uint64_t end = vmm_align_up(addr + len, PAGING_PAGE_SIZE);
+    if(!space || !len || addr % PAGING_PAGE_SIZE || end <= addr || (prot & ~VMM_FLAGS_PROT_MASK)) return false;
+
+    if(!(prot & VMM_FLAGS_READ))
+    {
+        log_line(LOG_WARN, "%s: Protection 0x%llx without read access isn't supported", __FUNCTION__, prot);
+        return false;
+    }
+
+    if(!vmm_range_allocated(space, addr, end))
+    {
+        log_line(LOG_WARN, "%s: 0x%llx - 0x%llx isn't allocated", __FUNCTION__, addr, end);
+        return false;
+    }
+
+    if(!vmm_change_area_flags(space, addr, end, prot, VMM_FLAGS_PROT_MASK)) return false;
+
+    // The changed areas were split at the ends, so a huge page that changes is either all inside or all outside
+    uint64_t *pml4 = hhdm_physToVirt(space->pml4_phys);
+    for(struct vm_area *area = vmm_lower_bound(space, addr); area != NULL && area->base < end; area = vmm_next_area(area))
+    {
+        uint64_t range_start = area->base > addr ? area->base : addr;
+        uint64_t range_end = area->base + area->size < end ? area->base + area->size : end;
+
+        // Device memory isn't counted, the other pages are writable only if they're private
+        paging_protect_region(pml4, range_start, range_end - range_start, vmm_generic_to_x86_flags(area->flags), !(area->flags & VMM_FLAGS_MMIO));
+    }
+
+    if(space != current_vas) vmm_pcid_invalidate(space);
+
+    return true;
+}
+
+/**
+ * @brief The memory management work done when the cpu is idle
+ * Called from the idle loop, it's rate limited so it can be called at every wake up
+ */
+void vmm_background_work(void)
+{
+    uint64_t now = timer_get_uptime_ms();
+
+    if(now - ws_last_scan_ms >= VMM_WS_SCAN_INTERVAL_MS)
+    {
+        ws_last_scan_ms = now;
+        vmm_scan_working_set(kernel_vas);
+        if(current_vas != kernel_vas) vmm_scan_working_set(current_vas);
+    }
+
+    if(now - thp_last_scan_ms >= VMM_THP_SCAN_INTERVAL_MS)
+    {
+        thp_last_scan_ms = now;
+        vmm_thp_collapse_scan(VMM_THP_SCAN_WINDOWS);
+    }
+
+    if(now - ksm_last_scan_ms >= VMM_KSM_SCAN_INTERVAL_MS)
+    {
+        ksm_last_scan_ms = now;
+        vmm_ksm_scan(VMM_KSM_PAGES_TO_SCAN);
+    }
+
+    vmm_willneed_work();
+    vmm_kswapd();
+}
@@ -0,0 +1,310 @@
+#include <common/logging.h>
+#include <common/dll.h>
+#include <common/lz4.h>
+#include <devices/timer.h>
+#include <libk/string.h>
+#include <memory/hhdm.h>
+#include <memory/kheap.h>
+#include <memory/paging.h>
+#include <memory/pmm.h>
+#include <memory/zswap.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A compressed cache in front of the swap device.
+// Pages written to swap are compressed with lz4 and, if they shrink enough,
+// kept in memory instead of reaching the device. The compressed objects live
+// in zspages, blocks of 1 to 4 contiguous pages that hold objects of a single
+// size class, so there's no per object metadata besides the handle of the slot
+
+static struct zswap_class classes[ZSWAP_NR_CLASSES];
+
+// The handle of each swap slot, 0 if the slot isn't in the pool
+static uint64_t *handles = NULL;
+static uint64_t nr_handles = 0;
+
+static uint64_t max_pool_pages = 0;
+static struct zswap_stats stats;
+
+// Compressor workspace and output, the objects are copied from here
+static uint16_t hash_table[LZ4_HASH_SIZE];
+static uint8_t scratch[ZSWAP_MAX_OBJECT_SIZE];
+
+/**
+ * @brief Returns an object of a zspage
+ * 
+ * @param zspage The zspage
+ * @param index The index of the object
+ * @return uint8_t* The address of the object
+ */
+static inline uint8_t *zswap_object(struct zswap_zspage *zspage, uint64_t index)
+{
+    return (uint8_t *)zspage + ZSWAP_CLASS_GRANULARITY + index * classes[zspage->class_index].size;
+}
+
+/**
+ * @brief Returns the zspage of a handle
+ * 
+ * @param handle The handle
+ * @return struct zswap_zspage* The zspage header
+ */
+static inline struct zswap_zspage *zswap_handle_zspage(uint64_t handle)
+{
+    return hhdm_physToVirt((void *)(handle & ~(uint64_t)ZSWAP_HANDLE_INDEX_MASK));
+}
+
+/**
+ * @brief Sets up the size classes
+ * Each class picks the zspage size that wastes the smallest fraction of memory
+ */
+static void zswap_init_classes(void)
+{
+    for(uint32_t i = 0; i < ZSWAP_NR_CLASSES; i++)
+    {
+        struct zswap_class *class = &classes[i];
+        class->size = (i + 1) * ZSWAP_CLASS_GRANULARITY;
+        class->order = 0;
+        class->capacity = 0;
+        dll_init(&class->partial);
+
+        uint64_t best_used = 0, best_bytes = 1;
+        for(uint32_t order = 0; order <= ZSWAP_MAX_ZSPAGE_ORDER; order++)
+        {
+            uint64_t bytes = (uint64_t)PAGING_PAGE_SIZE << order;
+            uint64_t capacity = (bytes - ZSWAP_CLASS_GRANULARITY) / class->size;
+
+            // used / bytes > best_used / best_bytes
+            if(capacity * class->size * best_bytes > best_used * bytes)
+            {
+                best_used = capacity * class->size;
+                best_bytes = bytes;
+                class->order = order;
+                class->capacity = capacity;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Allocates an object
+ * 
+ * @param class_index The size class
+ * @return uint64_t The handle (zspage physical address | object index), 0 if the pool is full
+ */
+static uint64_t zswap_alloc_object(uint32_t class_index)
+{
+    struct zswap_class *class = &classes[class_index];
+
+    if(dll_empty(&class->partial))
+    {
+        uint64_t pages = 1ull << class->order;
+        if(stats.pool_pages + pages > max_pool_pages) return 0;
+
+        uint64_t phys = pmm_alloc(pages * PAGING_PAGE_SIZE);
+        if(!phys) return 0;
+        stats.pool_pages += pages;
+
+        struct zswap_zspage *zspage = hhdm_physToVirt((void *)phys);
+        zspage->class_index = class_index;
+        zspage->used = 0;
+        zspage->free_head = 0;
+
+        // Every free object points to the next one
+        for(uint32_t i = 0; i < class->capacity; i++)
+        {
+            *(uint16_t *)zswap_object(zspage, i) = i + 1;
+        }
+
+        dll_add_after(&class->partial, &zspage->link);
+    }
+
+    struct zswap_zspage *zspage = (struct zswap_zspage *)((uint8_t *)class->partial.next - offsetof(struct zswap_zspage, link));
+
+    uint16_t index = zspage->free_head;
+    zspage->free_head = *(uint16_t *)zswap_object(zspage, index);
+    zspage->used++;
+
+    // Full zspages leave the partial list
+    if(zspage->used == class->capacity) dll_delete(&zspage->link);
+
+    return (uint64_t)hhdm_virtToPhys(zspage) | index;
+}
+
+/**
+ * @brief Frees an object, an empty zspage goes back to the pmm
+ * 
+ * @param handle The handle of the object
+ */
+static void zswap_free_object(uint64_t handle)
+{
+    struct zswap_zspage *zspage = zswap_handle_zspage(handle);
+    struct zswap_class *class = &classes[zspage->class_index];
+    uint16_t index = handle & ZSWAP_HANDLE_INDEX_MASK;
+    bool was_full = zspage->used == class->capacity;
+
+    *(uint16_t *)zswap_object(zspage, index) = zspage->free_head;
+    zspage->free_head = index;
+    zspage->used--;
+
+    if(!zspage->used)
+    {
+        if(!was_full) dll_delete(&zspage->link);
+
+        pmm_free((uint64_t)hhdm_virtToPhys(zspage), PAGING_PAGE_SIZE << class->order);
+        stats.pool_pages -= 1ull << class->order;
+    }
+    else if(was_full)
+    {
+        dll_add_after(&class->partial, &zspage->link);
+    }
+}
+
+/**
+ * @brief Initializes the compressed cache for a swap area
+ * 
+ * @param nr_slots How many slots the swap area has
+ * @return true if the cache is usable
+ */
+bool zswap_init(uint64_t nr_slots)
+{
+    // Touched while reclaiming, it must never be demand paged
+    handles = kmalloc_contig(nr_slots * sizeof(uint64_t), NULL);
+    if(!handles)
+    {
+        log_line(LOG_WARN, "%s: Not enough memory for %llu slots, compressed swap cache disabled", __FUNCTION__, nr_slots);
+        return false;
+    }
+    memset(handles, 0x00, nr_slots * sizeof(uint64_t));
+    nr_handles = nr_slots;
+
+    zswap_init_classes();
+    max_pool_pages = pmm_get_free_pages() * ZSWAP_MAX_POOL_PERCENT / 100;
+
+    log_line(LOG_SUCCESS, "%s: Compressed swap cache up to %llu KB", __FUNCTION__, max_pool_pages * PAGING_PAGE_SIZE / 1024);
+    return true;
+}
+
+/**
+ * @brief Compresses a page into the pool
+ * 
+ * @param slot The swap slot of the page
+ * @param phys The physical address of the page
+ * @return true if the page was stored, false if it must be written to the device
+ */
+bool zswap_store(uint64_t slot, uint64_t phys)
+{
+    if(slot >= nr_handles) return false;
+
+    uint64_t start = timer_get_tsc();
+    size_t len = lz4_compress(hhdm_physToVirt((void *)phys), PAGING_PAGE_SIZE, scratch, ZSWAP_MAX_OBJECT_SIZE - sizeof(uint16_t), hash_table);
+    stats.compress_cycles += timer_get_tsc() - start;
+    stats.compress_calls++;
+
+    if(!len)
+    {
+        stats.rejected_incompressible++;
+        return false;
+    }
+
+    // The object is the compressed length followed by the data
+    uint64_t handle = zswap_alloc_object((len + sizeof(uint16_t) - 1) / ZSWAP_CLASS_GRANULARITY);
+    if(!handle)
+    {
+        stats.rejected_pool_full++;
+        return false;
+    }
+
+    uint8_t *object = zswap_object(zswap_handle_zspage(handle), handle & ZSWAP_HANDLE_INDEX_MASK);
+    *(uint16_t *)object = len;
+    memcpy(object + sizeof(uint16_t), scratch, len);
+
+    if(handles[slot]) zswap_invalidate(slot);
+    handles[slot] = handle;
+
+    stats.stored_pages++;
+    stats.compressed_bytes += len;
+    stats.stores++;
+    return true;
+}
+
+/**
+ * @brief Decompresses a page from the pool
+ * The object stays in the pool until the slot is freed
+ * @param slot The swap slot of the page
+ * @param phys The physical address where the page is decompressed
+ * @return true if the page was in the pool
+ */
+bool zswap_load(uint64_t slot, uint64_t phys)
+{
+    if(slot >= nr_handles || !handles[slot]) return false;
+
+    uint64_t handle = handles[slot];
+    uint8_t *object = zswap_object(zswap_handle_zspage(handle), handle & ZSWAP_HANDLE_INDEX_MASK);
+
+    uint64_t start = timer_get_tsc();
+    size_t len = lz4_decompress(object + sizeof(uint16_t), *(uint16_t *)object, hhdm_physToVirt((void *)phys), PAGING_PAGE_SIZE);
+    stats.decompress_cycles += timer_get_tsc() - start;
+
+    if(len != PAGING_PAGE_SIZE)
+    {
+        log_line(LOG_ERROR, "%s: The compressed page of slot %llu is corrupted", __FUNCTION__, slot);
+        return false;
+    }
+
+    stats.loads++;
+    return true;
+}
+
+/**
+ * @brief Tells if the page of a slot is in the pool
+ * 
+ * @param slot The swap slot
+ * @return true if the page was compressed instead of being written to the device
+ */
+bool zswap_stored(uint64_t slot)
+{
+    return slot < nr_handles && handles[slot];
+}
+
+/**
+ * @brief Drops the page of a slot from the pool
+ * 
+ * @param slot The swap slot
+ */
+void zswap_invalidate(uint64_t slot)
+{
+    if(slot >= nr_handles || !handles[slot]) return;
+
+    uint64_t handle = handles[slot];
+    uint8_t *object = zswap_object(zswap_handle_zspage(handle), handle & ZSWAP_HANDLE_INDEX_MASK);
+
+    stats.stored_pages--;
+    stats.compressed_bytes -= *(uint16_t *)object;
+
+    zswap_free_object(handle);
+    handles[slot] = 0;
+}
+
+/**
+ * @brief Prints the compressed cache counters on the serial port
+ * The ratios are in hundredths
+ */
+void zswap_print_stats(void)
+{
+    if(!handles) return;
+
+    uint64_t stored_bytes = stats.stored_pages * PAGING_PAGE_SIZE;
+    uint64_t pool_bytes = stats.pool_pages * PAGING_PAGE_SIZE;
+
+    log_line(LOG_DEBUG, "%s: %llu pages stored in %llu KB of pool (max %llu KB)", __FUNCTION__,
+        stats.stored_pages, pool_bytes / 1024, max_pool_pages * PAGING_PAGE_SIZE / 1024);
+    log_line(LOG_DEBUG, "%s: Compression ratio %llu/100, effective ratio with the pool overhead %llu/100", __FUNCTION__,
+        stats.compressed_bytes ? stored_bytes * 100 / stats.compressed_bytes : 0,
+        pool_bytes ? stored_bytes * 100 / pool_bytes : 0);
+    log_line(LOG_DEBUG, "%s: %llu stores, %llu loads, %llu incompressible, %llu rejected with the pool full", __FUNCTION__,
+        stats.stores, stats.loads, stats.rejected_incompressible, stats.rejected_pool_full);
+    log_line(LOG_DEBUG, "%s: Average compress %llu ns, average decompress %llu ns", __FUNCTION__,
+        stats.compress_calls ? timer_tsc_to_ns(stats.compress_cycles / stats.compress_calls) : 0,
+        stats.loads ? timer_tsc_to_ns(stats.decompress_cycles / stats.loads) : 0);
+}